@@ -21,27 +21,218 @@
 // Announce values every 20 minutes
 #define ANNOUNCES_INTERVAL (20*60)
 
+// Spread refreshes by +/- 10% of the interval
+#define ANNOUNCES_JITTER (ANNOUNCES_INTERVAL / 10)
+
 
-static time_t g_announces_expire = 0;
-static time_t g_announces_announce = 0;
 static struct value_t *g_values = NULL;
 
+/*
+* Min-heap of all values ordered by the time they need attention,
+* either to be announced again or to be removed.
+*/
+static struct value_t **g_heap = NULL;
+static int g_heap_num = 0;
+static int g_heap_size = 0;
+
+// Hash index of all values by id
+static struct value_t **g_index = NULL;
+static int g_index_size = 0;
+static int g_values_num = 0;
+
+
+static time_t value_due(const struct value_t *value)
+{
+	return MIN(value->refresh, value->lifetime);
+}
+
+static void heap_swap(int a, int b)
+{
+	struct value_t *tmp = g_heap[a];
+
+	g_heap[a] = g_heap[b];
+	g_heap[b] = tmp;
+	g_heap[a]->heap_index = a;
+	g_heap[b]->heap_index = b;
+}
+
+static void heap_up(int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (value_due(g_heap[parent]) <= value_due(g_heap[i])) {
+			break;
+		}
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(int i)
+{
+	int min;
+	int c;
+
+	while (1) {
+		min = i;
+		c = 2 * i + 1;
+		if (c < g_heap_num && value_due(g_heap[c]) < value_due(g_heap[min])) {
+			min = c;
+		}
+		c += 1;
+		if (c < g_heap_num && value_due(g_heap[c]) < value_due(g_heap[min])) {
+			min = c;
+		}
+		if (min == i) {
+			break;
+		}
+		heap_swap(i, min);
+		i = min;
+	}
+}
+
+// Restore heap order after the due time of a value has changed
+static void heap_update(struct value_t *value)
+{
+	heap_up(value->heap_index);
+	heap_down(value->heap_index);
+}
+
+static int heap_insert(struct value_t *value)
+{
+	struct value_t **heap;
+	int size;
+
+	if (g_heap_num == g_heap_size) {
+		size = g_heap_size ? (2 * g_heap_size) : 64;
+		heap = (struct value_t**) realloc(g_heap, size * sizeof(struct value_t*));
+		if (heap == NULL) {
+			return EXIT_FAILURE;
+		}
+		g_heap = heap;
+		g_heap_size = size;
+	}
+
+	value->heap_index = g_heap_num;
+	g_heap[g_heap_num++] = value;
+	heap_up(value->heap_index);
+
+	return EXIT_SUCCESS;
+}
+
+// Remove the value at the given position
+static struct value_t *heap_pop_at(int i)
+{
+	struct value_t *value = g_heap[i];
+
+	g_heap_num -= 1;
+	if (i < g_heap_num) {
+		heap_swap(i, g_heap_num);
+		heap_up(i);
+		heap_down(i);
+	}
+	value->heap_index = -1;
+
+	return value;
+}
+
+// Remove the value with the earliest due time
+static struct value_t *heap_pop(void)
+{
+	return heap_pop_at(0);
+}
+
+// Next refresh time, spread to avoid bursts of searches
+static time_t announces_next_refresh(time_t now)
+{
+	return now + ANNOUNCES_INTERVAL - ANNOUNCES_JITTER + (random() % (2 * ANNOUNCES_JITTER + 1));
+}
+
 
 struct value_t* announces_get(void)
 {
 	return g_values;
 }
 
+// Ids are hashes already
+static int index_slot(const uint8_t id[], int size)
+{
+	uint32_t h;
+
+	memcpy(&h, id, sizeof(h));
+	return h & (size - 1);
+}
+
+static int index_insert(struct value_t *value)
+{
+	struct value_t **index;
+	struct value_t *cur;
+	struct value_t *next;
+	int size;
+	int i;
+
+	// Grow and rehash when the load factor exceeds 1
+	if (g_values_num >= g_index_size) {
+		size = g_index_size ? (2 * g_index_size) : 64;
+		index = (struct value_t**) calloc(size, sizeof(struct value_t*));
+		if (index == NULL) {
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < g_index_size; i++) {
+			cur = g_index[i];
+			while (cur) {
+				next = cur->index_next;
+				cur->index_next = index[index_slot(cur->id, size)];
+				index[index_slot(cur->id, size)] = cur;
+				cur = next;
+			}
+		}
+
+		free(g_index);
+		g_index = index;
+		g_index_size = size;
+	}
+
+	i = index_slot(value->id, g_index_size);
+	value->index_next = g_index[i];
+	g_index[i] = value;
+	g_values_num += 1;
+
+	return EXIT_SUCCESS;
+}
+
+static void index_remove(struct value_t *value)
+{
+	struct value_t **cur;
+
+	cur = &g_index[index_slot(value->id, g_index_size)];
+	while (*cur) {
+		if (*cur == value) {
+			*cur = value->index_next;
+			g_values_num -= 1;
+			return;
+		}
+		cur = &(*cur)->index_next;
+	}
+}
+
 struct value_t* announces_find(const uint8_t id[])
 {
 	struct value_t *value;
 
-	value = g_values;
+	if (g_index_size == 0) {
+		return NULL;
+	}
+
+	value = g_index[index_slot(id, g_index_size)];
 	while (value) {
 		if (id_equal(id, value->id)) {
 			return value;
 		}
-		value = value->next;
+		value = value->index_next;
 	}
 	return NULL;
 }
@@ -61,7 +252,7 @@ void announces_debug(FILE *fp)
 		fprintf(fp, " query: %s\n", value->query);
 		fprintf(fp, "  id: %s\n", str_id(value->id));
 		fprintf(fp, "  port: %d\n", value->port);
-		if (value->refresh < now) {
+		if (value->refresh <= now) {
 			fprintf(fp, "  refresh: now\n");
 		} else {
 			fprintf(fp, "  refresh: in %ld min\n", (value->refresh - now) / 60);
@@ -81,7 +272,7 @@ void announces_debug(FILE *fp)
 }
 
 // Announce a sanitzed query
-struct value_t *announces_add(const char query[], int port, time_t lifetime)
+struct value_t *announces_add(const char query[], int port, time_t lifetime, int source)
 {
 	uint8_t id[SHA1_BIN_LENGTH];
 	struct value_t *cur;
@@ -118,25 +309,49 @@ struct value_t *announces_add(const char query[], int port, time_t lifetime)
 
 	// Value already exists - refresh
 	if ((cur = announces_find(id)) != NULL) {
-		cur->refresh = now - 1;
+		// Do not change port or lifetime another source has set
+		if ((cur->sources & ~source) && (cur->port != port || (lifetime > now && cur->lifetime != lifetime))) {
+			log_warning("Announcement %s was added with other settings, keep port %d", query, cur->port);
+			cur->sources |= source;
+			return cur;
+		}
+
+		cur->port = port;
+		cur->refresh = now;
+		cur->sources |= source;
 
 		if (lifetime > now) {
 			cur->lifetime = lifetime;
 		}
 
-		// Trigger immediate handling
-		g_announces_announce = 0;
+		heap_update(cur);
 
 		return cur;
 	}
 
 	// Prepend new entry
 	new = (struct value_t*) calloc(1, sizeof(struct value_t));
+	if (new == NULL) {
+		return NULL;
+	}
+
 	memcpy(new->id, id, SHA1_BIN_LENGTH);
 	memcpy(new->query, query, strlen(query));
 	new->port = port;
-	new->refresh = now - 1; // Send first announcement as soon as possible
+	new->refresh = now; // Send first announcement as soon as possible
 	new->lifetime = lifetime;
+	new->sources = source;
+
+	if (heap_insert(new) != EXIT_SUCCESS) {
+		free(new);
+		return NULL;
+	}
+
+	if (index_insert(new) != EXIT_SUCCESS) {
+		heap_pop_at(new->heap_index);
+		free(new);
+		return NULL;
+	}
 
 	if (lifetime == LONG_MAX) {
 		log_debug("Add announcement for %s:%hu. Keep alive for entire runtime.", query, port);
@@ -148,9 +363,6 @@ struct value_t *announces_add(const char query[], int port, time_t lifetime)
 	new->next = g_values;
 	g_values = new;
 
-	// Trigger immediate handling
-	g_announces_announce = 0;
-
 	return new;
 }
 
@@ -159,62 +371,96 @@ void value_free(struct value_t *value)
 	free(value);
 }
 
+// Stop announcing a value, it will be removed on the next tick
+void announces_remove(const uint8_t id[], int source)
+{
+	struct value_t *value;
+
+	value = announces_find(id);
+	if (value) {
+		value->sources &= ~source;
+
+		// Keep values other sources still announce
+		if (value->sources == 0) {
+			value->lifetime = 0;
+			heap_update(value);
+		}
+	}
+}
+
+// Free all values that have been taken off the heap
 static void announces_expire(void)
 {
 	struct value_t *pre;
 	struct value_t *cur;
-	time_t now;
+	struct value_t *next;
 
-	now = time_now_sec();
 	pre = NULL;
 	cur = g_values;
 	while (cur) {
-		if (cur->lifetime < now) {
+		next = cur->next;
+		if (cur->heap_index < 0) {
 			if (pre) {
-				pre->next = cur->next;
+				pre->next = next;
 			} else {
-				g_values = cur->next;
+				g_values = next;
 			}
+			log_debug("Announcement expired: %s", cur->query);
+			index_remove(cur);
 			value_free(cur);
-			return;
+		} else {
+			pre = cur;
 		}
-		pre = cur;
-		cur = cur->next;
+		cur = next;
 	}
 }
 
-static void announces_announce(void)
+static void announces_handle(int _rc, int _sock)
 {
 	struct value_t *value;
+	int expired;
+	int searches;
 	time_t now;
 
+	if (g_heap_num == 0) {
+		return;
+	}
+
 	now = time_now_sec();
-	value = g_values;
-	while (value) {
-		if (value->refresh < now) {
-			log_debug("Announce %s:%hu", value->query, value->port);
-			kad_announce_once(value->id, value->port);
-			value->refresh = now + ANNOUNCES_INTERVAL;
+	expired = 0;
+	searches = -1;
+
+	while (g_heap_num > 0 && value_due(g_heap[0]) <= now) {
+		value = g_heap[0];
+
+		if (value->lifetime <= now) {
+			heap_pop();
+			expired += 1;
+			continue;
 		}
-		value = value->next;
-	}
-}
 
-static void announces_handle(int _rc, int _sock)
-{
-	// Expire search results
-	if (g_announces_expire <= time_now_sec()) {
-		announces_expire();
+		// Limit the number of announcement searches in flight
+		if (searches < 0) {
+			if (kad_count_nodes(0) == 0) {
+				break;
+			}
+			searches = kad_count_announce_searches();
+		}
 
-		// Try again in ~1 minute
-		g_announces_expire = time_add_mins(1);
-	}
+		if (searches >= gconf->announce_limit) {
+			break;
+		}
 
-	if (g_announces_announce <= time_now_sec() && kad_count_nodes(0) != 0) {
-		announces_announce();
+		log_debug("Announce %s:%hu", value->query, value->port);
+		kad_announce_once(value->id, value->port);
+		searches = kad_count_announce_searches();
 
-		// Try again in ~1 minute
-		g_announces_announce = time_add_mins(1);
+		value->refresh = announces_next_refresh(now);
+		heap_down(0);
+	}
+
+	if (expired) {
+		announces_expire();
 	}
 }
 
@@ -236,4 +482,14 @@ void announces_free(void)
 		cur = next;
 	}
 	g_values = NULL;
+
+	free(g_index);
+	g_index = NULL;
+	g_index_size = 0;
+	g_values_num = 0;
+
+	free(g_heap);
+	g_heap = NULL;
+	g_heap_num = 0;
+	g_heap_size = 0;
 }
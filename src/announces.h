@@ -5,6 +5,13 @@
 #include <sys/time.h>
 #include <stdio.h>
 
+// Default number of announcement searches in flight
+#define ANNOUNCES_LIMIT_DEFAULT 16
+
+// Sources that want a value to be announced
+#define ANNOUNCES_SOURCE_MANIFEST 1
+#define ANNOUNCES_SOURCE_OTHER 2
+
 /*
 * Announce a value id / port pair in regular
 * intervals until the lifetime expires.
@@ -17,6 +24,9 @@ struct value_t {
 	int port;
 	time_t lifetime; // Keep entry refreshed until the lifetime expires
 	time_t refresh; // Next time the entry need to be refreshed
+	int heap_index; // Position in the announcement schedule
+	int sources; // ANNOUNCES_SOURCE_* flags
+	struct value_t *index_next; // Next value in id index bucket
 };
 
 void announces_setup(void);
@@ -28,8 +38,14 @@ struct value_t* announces_find(const uint8_t id[]);
 // List all entries
 void announces_debug(FILE *fp);
 
-// Add a value id / port that will be announced until lifetime is exceeded
-struct value_t *announces_add(const char query[], int port, time_t lifetime);
+/*
+* Add a value id / port that will be announced until lifetime is exceeded.
+* Port and lifetime of a value are only changed by the source that added it.
+*/
+struct value_t *announces_add(const char query[], int port, time_t lifetime, int source);
+
+// Stop announcing a value when no other source wants it announced
+void announces_remove(const uint8_t id[], int source);
 
 
 #endif // _EXT_announces_H_
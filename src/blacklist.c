@@ -0,0 +1,297 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "net.h"
+#include "blacklist.h"
+
+
+/*
+* The entries are kept in a ring that is filled in insertion order.
+* Since all entries have the same lifetime, the oldest entry is also
+* the next to expire and the next to be replaced when the ring is full.
+* Lookups go through hash chains that link the entries by index.
+*/
+
+static struct blacklist_entry *g_entries = NULL;
+static int *g_buckets = NULL;
+static int g_buckets_num = 0;
+static int g_size = 0;
+static int g_oldest = 0;
+static int g_count = 0;
+static unsigned int g_changes = 0;
+
+
+static const uint8_t *blacklist_bytes(const IP *addr)
+{
+	if (addr->ss_family == AF_INET6) {
+		return (const uint8_t *) &((const IP6 *) addr)->sin6_addr;
+	} else {
+		return (const uint8_t *) &((const IP4 *) addr)->sin_addr;
+	}
+}
+
+static uint16_t blacklist_port(const IP *addr)
+{
+	if (addr->ss_family == AF_INET6) {
+		return ((const IP6 *) addr)->sin6_port;
+	} else {
+		return ((const IP4 *) addr)->sin_port;
+	}
+}
+
+// Get address and port, without other fields like the IPv6 scope
+static int blacklist_key(IP *key, const IP *addr, uint16_t port)
+{
+	memset(key, 0, sizeof(IP));
+
+	switch (addr->ss_family) {
+	case AF_INET:
+		((IP4 *) key)->sin_family = AF_INET;
+		((IP4 *) key)->sin_addr = ((const IP4 *) addr)->sin_addr;
+		((IP4 *) key)->sin_port = port;
+		return 4;
+	case AF_INET6:
+		((IP6 *) key)->sin6_family = AF_INET6;
+		((IP6 *) key)->sin6_addr = ((const IP6 *) addr)->sin6_addr;
+		((IP6 *) key)->sin6_port = port;
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+// FNV-1a over the address bytes and port
+static int blacklist_hash(const IP *key)
+{
+	const uint8_t *bytes = blacklist_bytes(key);
+	uint16_t port = blacklist_port(key);
+	uint32_t hash = 2166136261U;
+	int len;
+	int i;
+
+	len = (key->ss_family == AF_INET6) ? 16 : 4;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ bytes[i]) * 16777619U;
+	}
+	hash = (hash ^ (port & 0xFF)) * 16777619U;
+	hash = (hash ^ (port >> 8)) * 16777619U;
+
+	return hash & (g_buckets_num - 1);
+}
+
+static int blacklist_find(const IP *key, int len)
+{
+	struct blacklist_entry *entry;
+	int i;
+
+	i = g_buckets[blacklist_hash(key)];
+	while (i >= 0) {
+		entry = &g_entries[i];
+		if (entry->addr.ss_family == key->ss_family
+				&& blacklist_port(&entry->addr) == blacklist_port(key)
+				&& memcmp(blacklist_bytes(&entry->addr), blacklist_bytes(key), len) == 0) {
+			return i;
+		}
+		i = entry->next;
+	}
+
+	return -1;
+}
+
+int blacklist_entry_active(const struct blacklist_entry *entry)
+{
+	return entry->addr.ss_family != 0 && entry->expire > time_now_sec();
+}
+
+// Remove the oldest entry from the ring and its hash chain
+static void blacklist_remove_oldest(void)
+{
+	struct blacklist_entry *entry;
+	int *next;
+
+	entry = &g_entries[g_oldest];
+	g_changes += 1;
+
+	next = &g_buckets[blacklist_hash(&entry->addr)];
+	while (*next >= 0) {
+		if (*next == g_oldest) {
+			*next = entry->next;
+			break;
+		}
+		next = &g_entries[*next].next;
+	}
+
+	memset(entry, 0, sizeof(struct blacklist_entry));
+	entry->next = -1;
+
+	g_oldest = (g_oldest + 1) % g_size;
+	g_count -= 1;
+}
+
+static void blacklist_insert(const IP *key)
+{
+	struct blacklist_entry *entry;
+	int bucket;
+	int i;
+
+	// Replace the oldest entry
+	if (g_count == g_size) {
+		blacklist_remove_oldest();
+	}
+
+	i = (g_oldest + g_count) % g_size;
+	bucket = blacklist_hash(key);
+
+	entry = &g_entries[i];
+	memcpy(&entry->addr, key, sizeof(IP));
+	entry->expire = time_now_sec() + BLACKLIST_LIFETIME;
+	entry->next = g_buckets[bucket];
+
+	g_buckets[bucket] = i;
+	g_count += 1;
+}
+
+void blacklist_add(const IP *addr)
+{
+	IP key;
+	int len;
+
+	len = blacklist_key(&key, addr, blacklist_port(addr));
+	if (len == 0 || blacklist_find(&key, len) >= 0) {
+		return;
+	}
+
+	blacklist_insert(&key);
+	g_changes += 1;
+
+	log_debug("Blacklist %s", str_addr(addr));
+}
+
+int blacklist_contains(const IP *addr)
+{
+	IP key;
+	int len;
+	int i;
+
+	if (g_count == 0) {
+		return 0;
+	}
+
+	len = blacklist_key(&key, addr, blacklist_port(addr));
+	if (len == 0) {
+		return 0;
+	}
+
+	i = blacklist_find(&key, len);
+	if (i >= 0 && blacklist_entry_active(&g_entries[i])) {
+		return 1;
+	}
+
+	// Entry for all ports
+	blacklist_key(&key, addr, 0);
+	i = blacklist_find(&key, len);
+	if (i >= 0 && blacklist_entry_active(&g_entries[i])) {
+		return 1;
+	}
+
+	return 0;
+}
+
+const struct blacklist_entry *blacklist_entries(int *num)
+{
+	*num = g_size;
+	return g_entries;
+}
+
+int blacklist_count(void)
+{
+	return g_count;
+}
+
+unsigned int blacklist_changes(void)
+{
+	return g_changes;
+}
+
+void blacklist_debug(FILE *fp)
+{
+	const struct blacklist_entry *entry;
+	time_t now;
+	int count;
+	int i;
+
+	now = time_now_sec();
+	count = 0;
+	for (i = 0; i < g_count; i++) {
+		entry = &g_entries[(g_oldest + i) % g_size];
+		if (!blacklist_entry_active(entry)) {
+			continue;
+		}
+
+		fprintf(fp, " %s (expires in %ld min)\n", str_addr(&entry->addr), (entry->expire - now) / 60);
+		count += 1;
+	}
+
+	fprintf(fp, " Found %d blacklisted addresses.\n", count);
+}
+
+static void blacklist_handle(int _rc, int _sock)
+{
+	time_t now = time_now_sec();
+
+	// Oldest entries expire first
+	while (g_count > 0 && g_entries[g_oldest].expire <= now) {
+		blacklist_remove_oldest();
+	}
+}
+
+int blacklist_setup(void)
+{
+	int i;
+
+	g_size = gconf->blacklist_size;
+	g_buckets_num = 1;
+	while (g_buckets_num < g_size) {
+		g_buckets_num *= 2;
+	}
+
+	g_entries = (struct blacklist_entry*) calloc(g_size, sizeof(struct blacklist_entry));
+	g_buckets = (int*) malloc(g_buckets_num * sizeof(int));
+
+	if (g_entries == NULL || g_buckets == NULL) {
+		log_error("Failed to allocate blacklist of size %d", g_size);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < g_size; i++) {
+		g_entries[i].next = -1;
+	}
+
+	for (i = 0; i < g_buckets_num; i++) {
+		g_buckets[i] = -1;
+	}
+
+	g_oldest = 0;
+	g_count = 0;
+
+	// Cause the callback to be called in intervals
+	net_add_handler(-1, &blacklist_handle);
+
+	return EXIT_SUCCESS;
+}
+
+void blacklist_free(void)
+{
+	free(g_entries);
+	free(g_buckets);
+	g_entries = NULL;
+	g_buckets = NULL;
+	g_size = 0;
+	g_count = 0;
+}
@@ -0,0 +1,49 @@
+
+#ifndef _BLACKLIST_H_
+#define _BLACKLIST_H_
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+* Hashed blacklist of misbehaving nodes.
+* Entries are keyed by address and port and expire after a while.
+* A port of 0 (only added by hand) matches all ports.
+*/
+
+// Keep blacklisted addresses for one hour
+#define BLACKLIST_LIFETIME (60*60)
+
+// Default number of entries
+#define BLACKLIST_SIZE_DEFAULT 1024
+
+struct blacklist_entry {
+	IP addr; // Address family is 0 for an unused entry
+	time_t expire;
+	int next; // Next entry in hash chain or -1
+};
+
+int blacklist_setup(void);
+void blacklist_free(void);
+
+// Add an address, a port of 0 blacklists all ports
+void blacklist_add(const IP *addr);
+
+// Check if the address is blacklisted
+int blacklist_contains(const IP *addr);
+
+// Check if an entry is in effect
+int blacklist_entry_active(const struct blacklist_entry *entry);
+
+// All entries, unused entries have an address family of 0
+const struct blacklist_entry *blacklist_entries(int *num);
+
+// Number of entries in use
+int blacklist_count(void);
+
+// Incremented on every change
+unsigned int blacklist_changes(void);
+
+void blacklist_debug(FILE *fp);
+
+#endif // _BLACKLIST_H_
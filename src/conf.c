@@ -15,6 +15,9 @@
 #include "conf.h"
 #include "peerfile.h"
 #include "kad.h"
+#include "blacklist.h"
+#include "announces.h"
+#include "searches.h"
 #ifdef TLS
 #include "ext-tls-client.h"
 #include "ext-tls-server.h"
@@ -22,6 +25,9 @@
 #ifdef BOB
 #include "ext-bob.h"
 #endif
+#if defined(BOB) || defined(TLS)
+#include "workers.h"
+#endif
 #ifdef FWD
 #include "ext-fwd.h"
 #endif
@@ -74,9 +80,23 @@ static const char *kadnode_usage_str =
 "Usage: kadnode [OPTIONS]*\n"
 "\n"
 " --announce <name>:<port>		Announce a name and port.\n\n"
+" --announce-manifest <file>		Announce all names listed in a file, one <name>[:<port>[:<minutes>]]\n"
+"					per line. The file is reloaded when it changes.\n\n"
+" --announce-limit <count>		Maximum number of announcement searches at the same time.\n"
+"					Default: "STR(ANNOUNCES_LIMIT_DEFAULT)"\n\n"
+" --search-cache-size <count>		Maximum number of searches and their results to keep.\n"
+"					Default: "STR(SEARCHES_CACHE_SIZE_DEFAULT)"\n\n"
+" --search-max-results <count>		Maximum number of addresses to collect for each search.\n"
+"					Default: "STR(SEARCHES_MAX_RESULTS_DEFAULT)"\n\n"
+" --search-negative-ttl <seconds>	Time to remember queries that failed. Use 0 to disable.\n"
+"					Default: "STR(SEARCHES_NEGATIVE_TTL_DEFAULT)"\n\n"
+" --search-verified-ttl <seconds>	Time to trust verified addresses without authentication. Use 0 to disable.\n"
+"					Default: "STR(SEARCHES_VERIFIED_TTL_DEFAULT)"\n\n"
 " --peerfile <file>			Import/Export peers from and to a file.\n\n"
 " --peer <addr>				Add a static peer address.\n"
 "					This option may occur multiple times.\n\n"
+" --warmup <name>			Look up a name as soon as the DHT is ready and keep\n"
+"					the results fresh. This option may occur multiple times.\n\n"
 " --user <user>				Change the UUID after start.\n\n"
 " --port	<port>				Bind DHT to this port.\n"
 "					Default: "STR(DHT_PORT)"\n\n"
@@ -84,6 +104,12 @@ static const char *kadnode_usage_str =
 "					option on each line. Comments start after '#'.\n\n"
 " --ifname <interface>			Bind to this interface.\n"
 "					Default: <any>\n\n"
+" --blacklist-size <count>		Maximum number of blacklisted nodes.\n"
+"					Default: "STR(BLACKLIST_SIZE_DEFAULT)"\n\n"
+#ifdef __linux__
+" --dht-filter-enable			Attach a socket filter to drop malformed and blacklisted\n"
+"					DHT packets in the kernel.\n\n"
+#endif
 " --daemon				Run the node in background.\n\n"
 " --verbosity <level>			Verbosity level: quiet, verbose or debug.\n"
 "					Default: verbose\n\n"
@@ -100,6 +126,12 @@ static const char *kadnode_usage_str =
 "					The public key will be printed to the terminal before exit.\n\n"
 " --bob-load-key <file>			Read a secret key in PEM format and announce the public key.\n"
 "					This option may occur multiple times.\n\n"
+" --bob-sessions <count>			Maximum number of BOB verifications at the same time.\n"
+"					Default: "STR(BOB_SESSIONS_DEFAULT)"\n\n"
+#endif
+#if defined(BOB) || defined(TLS)
+" --crypto-workers <count>		Number of threads for BOB challenges and TLS handshakes.\n"
+"					Use 0 to do this in the main thread. Default: "STR(WORKERS_DEFAULT)"\n\n"
 #endif
 #ifdef CMD
 " --cmd-disable-stdin			Disable the local control interface.\n\n"
@@ -125,6 +157,8 @@ static const char *kadnode_usage_str =
 " --tls-server-cert <path>,<path>	Add a comma separated tuple of server certificate file and key.\n"
 "					This option may occur multiple times.\n"
 "					Example: kadnode.crt,kadnode.key\n\n"
+" --tls-client-connections <count>	Maximum number of parallel TLS connections to verify results.\n"
+"					Default: "STR(TLS_CLIENT_CONNECTIONS_DEFAULT)"\n\n"
 #endif
 #ifdef __CYGWIN__
 " --service-start			Start, install and remove KadNode as Windows service.\n"
@@ -150,6 +184,48 @@ void conf_defaults(void)
 		gconf->dht_port = DHT_PORT;
 	}
 
+	if (gconf->blacklist_size < 0) {
+		gconf->blacklist_size = BLACKLIST_SIZE_DEFAULT;
+	}
+
+	if (gconf->announce_limit < 0) {
+		gconf->announce_limit = ANNOUNCES_LIMIT_DEFAULT;
+	}
+
+	if (gconf->search_cache_size < 0) {
+		gconf->search_cache_size = SEARCHES_CACHE_SIZE_DEFAULT;
+	}
+
+	if (gconf->search_max_results < 0) {
+		gconf->search_max_results = SEARCHES_MAX_RESULTS_DEFAULT;
+	}
+
+	if (gconf->search_negative_ttl < 0) {
+		gconf->search_negative_ttl = SEARCHES_NEGATIVE_TTL_DEFAULT;
+	}
+
+	if (gconf->search_verified_ttl < 0) {
+		gconf->search_verified_ttl = SEARCHES_VERIFIED_TTL_DEFAULT;
+	}
+
+#ifdef BOB
+	if (gconf->bob_sessions < 0) {
+		gconf->bob_sessions = BOB_SESSIONS_DEFAULT;
+	}
+#endif
+
+#if defined(BOB) || defined(TLS)
+	if (gconf->crypto_workers < 0) {
+		gconf->crypto_workers = WORKERS_DEFAULT;
+	}
+#endif
+
+#ifdef TLS
+	if (gconf->tls_client_connections < 0) {
+		gconf->tls_client_connections = TLS_CLIENT_CONNECTIONS_DEFAULT;
+	}
+#endif
+
 #ifdef CMD
 	if (gconf->cmd_path == NULL) {
 		gconf->cmd_path = strdup(CMD_PATH);
@@ -221,6 +297,7 @@ void conf_free(void)
 	free(gconf->peerfile);
 	free(gconf->dht_ifname);
 	free(gconf->configfile);
+	free(gconf->announce_manifest);
 
 #ifdef CMD
 	free(gconf->cmd_path);
@@ -238,10 +315,13 @@ void conf_free(void)
 // Enumerate all options to keep binary size smaller
 enum OPCODE {
 	oAnnounce,
+	oAnnounceLimit,
+	oAnnounceManifest,
 	oQueryTld,
 	oPidFile,
 	oPeerFile,
 	oPeer,
+	oWarmup,
 	oVerbosity,
 	oCmdDisableStdin,
 	oCmdPath,
@@ -251,6 +331,7 @@ enum OPCODE {
 	oNssPath,
 	oTlsClientCert,
 	oTlsServerCert,
+	oTlsClientConnections,
 	oConfig,
 	oIpv4,
 	oIpv6,
@@ -263,7 +344,15 @@ enum OPCODE {
 	oServiceStart,
 	oBobCreateKey,
 	oBobLoadKey,
+	oBobSessions,
+	oCryptoWorkers,
 	oIfname,
+	oDhtFilterEnable,
+	oBlacklistSize,
+	oSearchCacheSize,
+	oSearchMaxResults,
+	oSearchNegativeTtl,
+	oSearchVerifiedTtl,
 	oUser,
 	oDaemon,
 	oHelp,
@@ -272,10 +361,13 @@ enum OPCODE {
 
 static struct option options[] = {
 	{"announce", required_argument, 0, oAnnounce},
+	{"announce-limit", required_argument, 0, oAnnounceLimit},
+	{"announce-manifest", required_argument, 0, oAnnounceManifest},
 	{"query-tld", required_argument, 0, oQueryTld},
 	{"pidfile", required_argument, 0, oPidFile},
 	{"peerfile", required_argument, 0, oPeerFile},
 	{"peer", required_argument, 0, oPeer},
+	{"warmup", required_argument, 0, oWarmup},
 	{"verbosity", required_argument, 0, oVerbosity},
 #ifdef CMD
 	{"cmd-disable-stdin", no_argument, 0, oCmdDisableStdin},
@@ -292,6 +384,7 @@ static struct option options[] = {
 #ifdef TLS
 	{"tls-client-cert", required_argument, 0, oTlsClientCert},
 	{"tls-server-cert", required_argument, 0, oTlsServerCert},
+	{"tls-client-connections", required_argument, 0, oTlsClientConnections},
 #endif
 	{"config", required_argument, 0, oConfig},
 	{"port", required_argument, 0, oPort},
@@ -312,8 +405,20 @@ static struct option options[] = {
 #ifdef BOB
 	{"bob-create-key", required_argument, 0, oBobCreateKey},
 	{"bob-load-key", required_argument, 0, oBobLoadKey},
+	{"bob-sessions", required_argument, 0, oBobSessions},
+#endif
+#if defined(BOB) || defined(TLS)
+	{"crypto-workers", required_argument, 0, oCryptoWorkers},
 #endif
 	{"ifname", required_argument, 0, oIfname},
+#ifdef __linux__
+	{"dht-filter-enable", no_argument, 0, oDhtFilterEnable},
+#endif
+	{"blacklist-size", required_argument, 0, oBlacklistSize},
+	{"search-cache-size", required_argument, 0, oSearchCacheSize},
+	{"search-max-results", required_argument, 0, oSearchMaxResults},
+	{"search-negative-ttl", required_argument, 0, oSearchNegativeTtl},
+	{"search-verified-ttl", required_argument, 0, oSearchVerifiedTtl},
 	{"user", required_argument, 0, oUser},
 	{"daemon", no_argument, 0, oDaemon},
 	{"help", no_argument, 0, oHelp},
@@ -351,6 +456,25 @@ static int conf_port(const char opt[], int *dst, const char src[])
 	return 0;
 }
 
+static int conf_int(const char opt[], int *dst, const char src[], int min, int max)
+{
+	int n;
+	char c;
+
+	if (sscanf(src, "%d%c", &n, &c) != 1 || n < min || n > max) {
+		log_error("Invalid value for %s: %s (expected %d - %d)", opt, src, min, max);
+		return 1;
+	}
+
+	if (*dst >= 0) {
+		log_error("Value was already set for %s: %s", opt, src);
+		return 1;
+	}
+
+	*dst = n;
+	return 0;
+}
+
 // forward declaration
 int conf_parse(int argc, char **argv);
 
@@ -472,6 +596,12 @@ int conf_parse(int argc, char **argv)
 		case oAnnounce:
 			array_append(&g_announce_args[0], optarg);
 			break;
+		case oAnnounceLimit:
+			ret = conf_int(optname, &gconf->announce_limit, optarg, 1, 1024);
+			break;
+		case oAnnounceManifest:
+			ret = conf_str(optname, &gconf->announce_manifest, optarg);
+			break;
 		case oQueryTld:
 			ret = conf_str(optname, &gconf->query_tld, optarg);
 			break;
@@ -484,6 +614,9 @@ int conf_parse(int argc, char **argv)
 		case oPeer:
 			ret = peerfile_add_peer(optarg);
 			break;
+		case oWarmup:
+			ret = searches_add_warmup(optarg);
+			break;
 		case oVerbosity:
 			if (strcmp(optarg, "quiet") == 0) {
 				gconf->verbosity = VERBOSITY_QUIET;
@@ -527,6 +660,9 @@ int conf_parse(int argc, char **argv)
 		case oTlsServerCert:
 			array_append(&g_tls_server_args[0], optarg);
 			break;
+		case oTlsClientConnections:
+			ret = conf_int(optname, &gconf->tls_client_connections, optarg, 1, 256);
+			break;
 #endif
 		case oConfig:
 			ret = conf_str(optname, &gconf->configfile, optarg);
@@ -570,6 +706,26 @@ int conf_parse(int argc, char **argv)
 		case oIfname:
 			ret = conf_str(optname, &gconf->dht_ifname, optarg);
 			break;
+#ifdef __linux__
+		case oDhtFilterEnable:
+			gconf->dht_filter_enable = 1;
+			break;
+#endif
+		case oBlacklistSize:
+			ret = conf_int(optname, &gconf->blacklist_size, optarg, 16, 1000000);
+			break;
+		case oSearchCacheSize:
+			ret = conf_int(optname, &gconf->search_cache_size, optarg, 8, 1000000);
+			break;
+		case oSearchMaxResults:
+			ret = conf_int(optname, &gconf->search_max_results, optarg, 1, SEARCHES_MAX_RESULTS_LIMIT);
+			break;
+		case oSearchNegativeTtl:
+			ret = conf_int(optname, &gconf->search_negative_ttl, optarg, 0, 24 * 60 * 60);
+			break;
+		case oSearchVerifiedTtl:
+			ret = conf_int(optname, &gconf->search_verified_ttl, optarg, 0, 24 * 60 * 60);
+			break;
 		case oUser:
 			ret = conf_str(optname, &gconf->user, optarg);
 			break;
@@ -590,6 +746,14 @@ int conf_parse(int argc, char **argv)
 		case oBobLoadKey:
 			ret = bob_load_key(optarg);
 			break;
+		case oBobSessions:
+			ret = conf_int(optname, &gconf->bob_sessions, optarg, 8, 4096);
+			break;
+#endif
+#if defined(BOB) || defined(TLS)
+		case oCryptoWorkers:
+			ret = conf_int(optname, &gconf->crypto_workers, optarg, 0, 64);
+			break;
 #endif
 		default:
 			log_error("Unhandled parameter %d", c);
@@ -662,7 +826,22 @@ int conf_setup(int argc, char **argv)
 	gconf = (struct gconf_t*) calloc(1, sizeof(struct gconf_t));
 	*gconf = ((struct gconf_t) {
 		.dht_port = -1,
+		.blacklist_size = -1,
+		.announce_limit = -1,
+		.search_cache_size = -1,
+		.search_max_results = -1,
+		.search_negative_ttl = -1,
+		.search_verified_ttl = -1,
 		.af = AF_UNSPEC,
+#ifdef TLS
+		.tls_client_connections = -1,
+#endif
+#ifdef BOB
+		.bob_sessions = -1,
+#endif
+#if defined(BOB) || defined(TLS)
+		.crypto_workers = -1,
+#endif
 #ifdef DNS
 		.dns_port = -1,
 #endif
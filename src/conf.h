@@ -58,6 +58,32 @@ struct gconf_t {
 	// DHT interface
 	char *dht_ifname;
 
+	// Number of blacklist entries
+	int blacklist_size;
+
+	// Maximum number of announcement searches in flight
+	int announce_limit;
+
+	// Announce names listed in this file
+	char *announce_manifest;
+
+	// Maximum number of cached searches
+	int search_cache_size;
+
+	// Maximum number of results per search
+	int search_max_results;
+
+	// Seconds to remember failed queries
+	int search_negative_ttl;
+
+	// Seconds to trust verified results without authentication
+	int search_verified_ttl;
+
+#ifdef __linux__
+	// Drop unwanted DHT packets in the kernel
+	int dht_filter_enable;
+#endif
+
 #ifdef __CYGWIN__
 	// Start as windows service
 	int service_start;
@@ -84,6 +110,21 @@ struct gconf_t {
 	char *dns_proxy_server;
 #endif
 
+#ifdef TLS
+	// Maximum number of parallel TLS client connections
+	int tls_client_connections;
+#endif
+
+#ifdef BOB
+	// Maximum number of parallel BOB verifications
+	int bob_sessions;
+#endif
+
+#if defined(BOB) || defined(TLS)
+	// Number of threads for signatures, verifications and handshakes
+	int crypto_workers;
+#endif
+
 #ifdef NSS
 	char *nss_path;
 #endif
@@ -205,6 +205,12 @@ struct peer {
 #define DHT_SEARCH_EXPIRE_TIME (62 * 60)
 #endif
 
+/* How long we keep write tokens to refresh an announcement without
+   walking the DHT again.  Nodes that reject a token are asked again. */
+#ifndef DHT_TOKEN_REUSE_TIME
+#define DHT_TOKEN_REUSE_TIME (25 * 60)
+#endif
+
 /* The maximum number of in-flight queries per search. */
 #ifndef DHT_INFLIGHT_QUERIES
 #define DHT_INFLIGHT_QUERIES 4
@@ -215,11 +221,24 @@ struct peer {
 #define DHT_SEARCH_RETRANSMIT 10
 #endif
 
+/* Peers are served from pre-encoded "values" entries per address family,
+   rebuilt when peers are added or expired.  The closest nodes sent along
+   with them are cached for a few seconds. */
+#define STORAGE_VALUE_SIZE(af) ((af) == AF_INET ? 2 + 6 : 3 + 18)
+#define STORAGE_NODES_CACHE_TIME 5
+
 struct storage {
     unsigned char id[20];
     int numpeers, maxpeers;
     struct peer *peers;
     struct storage *next;
+    /* Index 0 for IPv4, 1 for IPv6. */
+    unsigned char *values[2];
+    int numvalues[2], nextvalue[2];
+    int values_dirty;
+    unsigned char nodes[8 * 26], nodes6[8 * 38];
+    int numnodes, numnodes6;
+    time_t nodes_time;
 };
 
 static struct storage * find_storage(const unsigned char *id);
@@ -308,16 +327,10 @@ static int numstorage;
 
 static struct search *searches = NULL;
 static int numsearches;
+/* Searches that are not done and will announce a port. */
+static int numannouncesearches;
 static unsigned short search_id;
 
-/* The maximum number of nodes that we snub.  There is probably little
-   reason to increase this value. */
-#ifndef DHT_MAX_BLACKLISTED
-#define DHT_MAX_BLACKLISTED 10
-#endif
-static struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
-int next_blacklisted;
-
 static struct timeval now;
 static time_t mybucket_grow_time, mybucket6_grow_time;
 static time_t expire_stuff_time;
@@ -325,6 +338,30 @@ static time_t expire_stuff_time;
 #define MAX_TOKEN_BUCKET_TOKENS 400
 static time_t token_bucket_time;
 static int token_bucket_tokens;
+static unsigned long token_bucket_drops;
+
+/* Requests are also accounted to the /24 (IPv4) or /64 (IPv6) prefix of
+   the sender, so that a single flooding network cannot use up the global
+   token bucket.  The table is a small hash with a few probes per lookup;
+   the least recently seen prefix is replaced when no slot is free. */
+#ifndef DHT_RATE_PREFIXES
+#define DHT_RATE_PREFIXES 256
+#endif
+#define RATE_PREFIX_PROBES 4
+#define MAX_PREFIX_BUCKET_TOKENS 40
+#define PREFIX_BUCKET_RATE 10
+
+struct rate_prefix {
+    unsigned char prefix[8];
+    int len;                    /* prefix length in bytes, 0 if unused */
+    time_t time;                /* time of last refill */
+    time_t seen;                /* time of last request */
+    int tokens;
+    unsigned long drops;        /* requests dropped for this prefix */
+};
+
+static struct rate_prefix rate_prefixes[DHT_RATE_PREFIXES];
+static unsigned long rate_prefix_drops;
 
 FILE *dht_debug = NULL;
 
@@ -645,8 +682,8 @@ pinged(struct node *n, struct bucket *b)
         send_cached_ping(b ? b : find_bucket(n->id, n->ss.ss_family));
 }
 
-/* The internal blacklist is an LRU cache of nodes that have sent
-   incorrect messages. */
+/* Nodes that have sent incorrect messages are passed to the user's
+   blacklist, which is consulted through dht_blacklisted. */
 static void
 blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
 {
@@ -673,27 +710,16 @@ blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
         }
     }
     /* And make sure we don't hear from it again. */
-    memcpy(&blacklist[next_blacklisted], sa, salen);
-    next_blacklisted = (next_blacklisted + 1) % DHT_MAX_BLACKLISTED;
+    dht_blacklist(sa, salen);
 }
 
 static int
 node_blacklisted(const struct sockaddr *sa, int salen)
 {
-    int i;
-
     if((unsigned)salen > sizeof(struct sockaddr_storage))
         abort();
 
-    if(dht_blacklisted(sa, salen))
-        return 1;
-
-    for(i = 0; i < DHT_MAX_BLACKLISTED; i++) {
-        if(memcmp(&blacklist[i], sa, salen) == 0)
-            return 1;
-    }
-
-    return 0;
+    return dht_blacklisted(sa, salen);
 }
 
 static struct node *
@@ -1103,6 +1129,8 @@ expire_searches(dht_callback *callback, void *closure)
             else
                 searches = next;
             numsearches--;
+            if(!sr->done && sr->port != 0)
+                numannouncesearches--;
             if (!sr->done) {
                 if(callback)
                     (*callback)(closure,
@@ -1151,6 +1179,37 @@ search_send_get_peers(struct search *sr, struct search_node *n)
     return 1;
 }
 
+/* A node sent an error in reply to our announce_peer, most likely because
+   we reused a token that has become stale.  Fetch a fresh token from that
+   node, or give up on it if the token was fresh already. */
+static void
+search_announce_rejected(unsigned short tid,
+                         const struct sockaddr *sa, int salen)
+{
+    struct search *sr;
+    int i;
+
+    sr = find_search(tid, sa->sa_family);
+    if(sr == NULL || sr->port == 0)
+        return;
+
+    for(i = 0; i < sr->numnodes; i++) {
+        struct search_node *n = &sr->nodes[i];
+        if(n->sslen != salen || memcmp(&n->ss, sa, salen) != 0)
+            continue;
+        if(n->reply_time >= now.tv_sec - 6 * DHT_SEARCH_RETRANSMIT) {
+            n->acked = 1;
+        } else {
+            n->token_len = 0;
+            n->replied = 0;
+            n->pinged = 0;
+            n->request_time = 0;
+            search_send_get_peers(sr, n);
+        }
+        break;
+    }
+}
+
 /* Insert a new node into any incomplete search. */
 static void
 add_search_node(const unsigned char *id, const struct sockaddr *sa, int salen)
@@ -1241,6 +1300,8 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
     return;
 
  done:
+    if(sr->port != 0)
+        numannouncesearches--;
     sr->done = 1;
     if(callback)
         (*callback)(closure,
@@ -1354,6 +1415,8 @@ dht_search(const unsigned char *id, int port, int af,
         /* We're reusing data from an old search.  Reusing the same tid
            means that we can merge replies for both searches. */
         int i;
+        if(!sr->done && sr->port != 0)
+            numannouncesearches--;
         sr->done = 0;
     again:
         for(i = 0; i < sr->numnodes; i++) {
@@ -1364,6 +1427,14 @@ dht_search(const unsigned char *id, int port, int af,
                 flush_search_node(n, sr);
                 goto again;
             }
+            /* When refreshing an announcement, keep recent tokens so that
+               search_step can send announce_peer right away. */
+            if(port != 0 && n->replied && n->token_len > 0 &&
+               n->reply_time >= now.tv_sec - DHT_TOKEN_REUSE_TIME) {
+                n->pinged = 0;
+                n->acked = 0;
+                continue;
+            }
             n->pinged = 0;
             n->token_len = 0;
             n->replied = 0;
@@ -1384,6 +1455,8 @@ dht_search(const unsigned char *id, int port, int af,
     }
 
     sr->port = port;
+    if(port != 0)
+        numannouncesearches++;
 
     insert_search_bucket(b, sr);
 
@@ -1486,6 +1559,7 @@ storage_store(const unsigned char *id,
         p->len = len;
         memcpy(p->ip, ip, len);
         p->port = port;
+        st->values_dirty = 1;
         return 1;
     }
 }
@@ -1501,6 +1575,7 @@ expire_storage(void)
                 if(i != st->numpeers - 1)
                     st->peers[i] = st->peers[st->numpeers - 1];
                 st->numpeers--;
+                st->values_dirty = 1;
             } else {
                 i++;
             }
@@ -1508,6 +1583,8 @@ expire_storage(void)
 
         if(st->numpeers == 0) {
             free(st->peers);
+            free(st->values[0]);
+            free(st->values[1]);
             if(previous)
                 previous->next = st->next;
             else
@@ -1530,6 +1607,52 @@ expire_storage(void)
     return 1;
 }
 
+/* Encode all peers of a storage as bencoded strings of fixed size. */
+static int
+storage_encode_values(struct storage *st)
+{
+    int f, i, len, size;
+    unsigned short swapped;
+    unsigned char *p;
+
+    for(f = 0; f < 2; f++) {
+        len = f == 0 ? 4 : 16;
+        size = STORAGE_VALUE_SIZE(f == 0 ? AF_INET : AF_INET6);
+
+        free(st->values[f]);
+        st->values[f] = NULL;
+        st->numvalues[f] = 0;
+
+        for(i = 0; i < st->numpeers; i++)
+            if(st->peers[i].len == len)
+                st->numvalues[f]++;
+
+        if(st->numvalues[f] == 0)
+            continue;
+
+        st->values[f] = malloc(st->numvalues[f] * size);
+        if(st->values[f] == NULL) {
+            st->numvalues[f] = 0;
+            return -1;
+        }
+
+        p = st->values[f];
+        for(i = 0; i < st->numpeers; i++) {
+            if(st->peers[i].len != len)
+                continue;
+            swapped = htons(st->peers[i].port);
+            memcpy(p, len == 4 ? "6:" : "18:", size - len - 2);
+            p += size - len - 2;
+            memcpy(p, st->peers[i].ip, len);
+            memcpy(p + len, &swapped, 2);
+            p += len + 2;
+        }
+    }
+
+    st->values_dirty = 0;
+    return 1;
+}
+
 static int
 rotate_secrets(void)
 {
@@ -1759,6 +1882,7 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
 
     searches = NULL;
     numsearches = 0;
+    numannouncesearches = 0;
 
     storage = NULL;
     numstorage = 0;
@@ -1797,10 +1921,12 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     search_id = random() & 0xFFFF;
     search_time = 0;
 
-    next_blacklisted = 0;
-
     token_bucket_time = now.tv_sec;
     token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
+    token_bucket_drops = 0;
+
+    memset(rate_prefixes, 0, sizeof(rate_prefixes));
+    rate_prefix_drops = 0;
 
     memset(secret, 0, sizeof(secret));
     rc = rotate_secrets();
@@ -1860,6 +1986,8 @@ dht_uninit()
         struct storage *st = storage;
         storage = storage->next;
         free(st->peers);
+        free(st->values[0]);
+        free(st->values[1]);
         free(st);
     }
 
@@ -1874,18 +2002,79 @@ dht_uninit()
 
 /* Rate control for requests we receive. */
 
+static struct rate_prefix *
+find_rate_prefix(const struct sockaddr *sa)
+{
+    const unsigned char *ip;
+    struct rate_prefix *rp, *victim = NULL;
+    unsigned int h = 2166136261U;
+    int i, len;
+
+    if(sa->sa_family == AF_INET) {
+        ip = (const unsigned char*)&((struct sockaddr_in*)sa)->sin_addr;
+        len = 3;
+    } else if(sa->sa_family == AF_INET6) {
+        ip = (const unsigned char*)&((struct sockaddr_in6*)sa)->sin6_addr;
+        len = 8;
+    } else {
+        return NULL;
+    }
+
+    for(i = 0; i < len; i++)
+        h = (h ^ ip[i]) * 16777619U;
+
+    for(i = 0; i < RATE_PREFIX_PROBES; i++) {
+        rp = &rate_prefixes[(h + i) % DHT_RATE_PREFIXES];
+        if(rp->len == len && memcmp(rp->prefix, ip, len) == 0)
+            return rp;
+        /* Prefer unused slots, then the least recently seen prefix. */
+        if(victim == NULL ||
+           (victim->len != 0 && (rp->len == 0 || rp->seen < victim->seen)))
+            victim = rp;
+    }
+
+    memset(victim, 0, sizeof(struct rate_prefix));
+    memcpy(victim->prefix, ip, len);
+    victim->len = len;
+    victim->time = now.tv_sec;
+    victim->tokens = MAX_PREFIX_BUCKET_TOKENS;
+    return victim;
+}
+
 static int
-token_bucket(void)
+token_bucket(const struct sockaddr *sa)
 {
+    struct rate_prefix *rp = find_rate_prefix(sa);
+
+    if(rp) {
+        rp->seen = now.tv_sec;
+        if(rp->time < now.tv_sec) {
+            rp->tokens = MIN(MAX_PREFIX_BUCKET_TOKENS,
+                             rp->tokens + PREFIX_BUCKET_RATE *
+                             (now.tv_sec - rp->time));
+            rp->time = now.tv_sec;
+        }
+
+        if(rp->tokens == 0) {
+            rp->drops++;
+            rate_prefix_drops++;
+            return 0;
+        }
+    }
+
     if(token_bucket_tokens == 0) {
         token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
                                   100 * (now.tv_sec - token_bucket_time));
         token_bucket_time = now.tv_sec;
     }
 
-    if(token_bucket_tokens == 0)
+    if(token_bucket_tokens == 0) {
+        token_bucket_drops++;
         return 0;
+    }
 
+    if(rp)
+        rp->tokens--;
     token_bucket_tokens--;
     return 1;
 }
@@ -2051,6 +2240,12 @@ dht_periodic(const void *buf, size_t buflen,
                                 values, &values_len, values6, &values6_len,
                                 &want);
 
+        if(message == ERROR && tid_len == 4 && tid_match(tid, "ap", &ttid)) {
+            debugf("Got error reply to announce_peer.\n");
+            search_announce_rejected(ttid, from, fromlen);
+            goto dontread;
+        }
+
         if(message < 0 || message == ERROR || id_cmp(id, zeroes) == 0) {
             debugf("Unparseable message: ");
             debug_printable(buf, buflen);
@@ -2065,7 +2260,7 @@ dht_periodic(const void *buf, size_t buflen,
 
         if(message > REPLY) {
             /* Rate limit requests. */
-            if(!token_bucket()) {
+            if(!token_bucket(from)) {
                 debugf("Dropping request due to rate limiting.\n");
                 goto dontread;
             }
@@ -2578,7 +2773,7 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
                  const unsigned char *token, int token_len)
 {
     char buf[2048];
-    int i = 0, rc, j0, j, k, len;
+    int i = 0, rc, j0, j, k, f, size;
 
     rc = snprintf(buf + i, 2048 - i, "d1:rd2:id20:"); INC(i, rc, 2048);
     COPY(buf, i, myid, 20, 2048);
@@ -2599,28 +2794,24 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
     }
 
     if(st && st->numpeers > 0) {
-        /* We treat the storage as a circular list, and serve a randomly
-           chosen slice.  In order to make sure we fit within 1024 octets,
-           we limit ourselves to 50 peers. */
+        /* We treat the pre-encoded values as a circular list, and serve
+           the next slice on every request.  In order to make sure we fit
+           within 1024 octets, we limit ourselves to 50 peers. */
 
-        len = af == AF_INET ? 4 : 16;
-        j0 = random() % st->numpeers;
-        j = j0;
-        k = 0;
+        f = af == AF_INET ? 0 : 1;
+        size = STORAGE_VALUE_SIZE(af);
+        if(st->values_dirty)
+            storage_encode_values(st);
 
         rc = snprintf(buf + i, 2048 - i, "6:valuesl"); INC(i, rc, 2048);
-        do {
-            if(st->peers[j].len == len) {
-                unsigned short swapped;
-                swapped = htons(st->peers[j].port);
-                rc = snprintf(buf + i, 2048 - i, "%d:", len + 2);
-                INC(i, rc, 2048);
-                COPY(buf, i, st->peers[j].ip, len, 2048);
-                COPY(buf, i, &swapped, 2, 2048);
-                k++;
-            }
-            j = (j + 1) % st->numpeers;
-        } while(j != j0 && k < 50);
+        if(st->numvalues[f] > 0) {
+            j0 = st->nextvalue[f] % st->numvalues[f];
+            k = MIN(st->numvalues[f], 50);
+            j = MIN(k, st->numvalues[f] - j0);
+            COPY(buf, i, st->values[f] + j0 * size, j * size, 2048);
+            COPY(buf, i, st->values[f], (k - j) * size, 2048);
+            st->nextvalue[f] = (j0 + k) % st->numvalues[f];
+        }
         rc = snprintf(buf + i, 2048 - i, "e"); INC(i, rc, 2048);
     }
 
@@ -2696,45 +2887,77 @@ buffer_closest_nodes(unsigned char *nodes, int numnodes,
     return numnodes;
 }
 
-int
-send_closest_nodes(const struct sockaddr *sa, int salen,
-                   const unsigned char *tid, int tid_len,
-                   const unsigned char *id, int want,
-                   int af, struct storage *st,
-                   const unsigned char *token, int token_len)
+static void
+find_closest_nodes(const unsigned char *id, int want,
+                   unsigned char *nodes, int *numnodes,
+                   unsigned char *nodes6, int *numnodes6)
 {
-    unsigned char nodes[8 * 26];
-    unsigned char nodes6[8 * 38];
-    int numnodes = 0, numnodes6 = 0;
     struct bucket *b;
 
-    if(want < 0)
-        want = sa->sa_family == AF_INET ? WANT4 : WANT6;
+    *numnodes = 0;
+    *numnodes6 = 0;
 
     if((want & WANT4)) {
         b = find_bucket(id, AF_INET);
         if(b) {
-            numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
+            *numnodes = buffer_closest_nodes(nodes, *numnodes, id, b);
             if(b->next)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b->next);
+                *numnodes = buffer_closest_nodes(nodes, *numnodes, id, b->next);
             b = previous_bucket(b);
             if(b)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
+                *numnodes = buffer_closest_nodes(nodes, *numnodes, id, b);
         }
     }
 
     if((want & WANT6)) {
         b = find_bucket(id, AF_INET6);
         if(b) {
-            numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
+            *numnodes6 = buffer_closest_nodes(nodes6, *numnodes6, id, b);
             if(b->next)
-                numnodes6 =
-                    buffer_closest_nodes(nodes6, numnodes6, id, b->next);
+                *numnodes6 =
+                    buffer_closest_nodes(nodes6, *numnodes6, id, b->next);
             b = previous_bucket(b);
             if(b)
-                numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
+                *numnodes6 = buffer_closest_nodes(nodes6, *numnodes6, id, b);
+        }
+    }
+}
+
+int
+send_closest_nodes(const struct sockaddr *sa, int salen,
+                   const unsigned char *tid, int tid_len,
+                   const unsigned char *id, int want,
+                   int af, struct storage *st,
+                   const unsigned char *token, int token_len)
+{
+    unsigned char nodes[8 * 26];
+    unsigned char nodes6[8 * 38];
+    int numnodes = 0, numnodes6 = 0;
+
+    if(want < 0)
+        want = sa->sa_family == AF_INET ? WANT4 : WANT6;
+
+    if(st) {
+        /* Hot hashes get many requests, reuse recently found nodes. */
+        if(st->nodes_time + STORAGE_NODES_CACHE_TIME <= now.tv_sec) {
+            find_closest_nodes(id, WANT4 | WANT6,
+                               st->nodes, &st->numnodes,
+                               st->nodes6, &st->numnodes6);
+            st->nodes_time = now.tv_sec;
         }
+        debugf("  (%d+%d cached nodes.)\n",
+               (want & WANT4) ? st->numnodes : 0,
+               (want & WANT6) ? st->numnodes6 : 0);
+
+        return send_nodes_peers(sa, salen, tid, tid_len,
+                                st->nodes,
+                                (want & WANT4) ? st->numnodes * 26 : 0,
+                                st->nodes6,
+                                (want & WANT6) ? st->numnodes6 * 38 : 0,
+                                af, st, token, token_len);
     }
+
+    find_closest_nodes(id, want, nodes, &numnodes, nodes6, &numnodes6);
     debugf("  (%d+%d nodes.)\n", numnodes, numnodes6);
 
     return send_nodes_peers(sa, salen, tid, tid_len,
@@ -57,6 +57,7 @@ int dht_uninit(void);
 int dht_sendto(int sockfd, const void *buf, int len, int flags,
                const struct sockaddr *to, int tolen);
 int dht_blacklisted(const struct sockaddr *sa, int salen);
+void dht_blacklist(const struct sockaddr *sa, int salen);
 void dht_hash(void *hash_return, int hash_size,
               const void *v1, int len1,
               const void *v2, int len2,
@@ -21,6 +21,7 @@
 #include "net.h"
 #include "announces.h"
 #include "searches.h"
+#include "workers.h"
 #include "ext-bob.h"
 
 
@@ -40,36 +41,174 @@
 * 3. get response "BOB" + SIGNED_CHALLENGE
 *    - find challenge by sender IP address
 * 4. verify signature by public key
+*
+* Signing and verification run on the worker threads (see workers.h).
+* Workers only use their own contexts and the bytes copied into a job.
 */
 
 #define ECPARAMS MBEDTLS_ECP_DP_SECP256R1
 #define ECPARAMS_NAME "secp256r1"
 #define ECPARAMS_SIZE 32
 #define MAX_AUTH_CHALLENGE_SEND 3
+
+// Retransmission timeout of challenges (ms)
+#define BOB_RTO_INITIAL 1000
+#define BOB_RTO_MIN 200
+#define BOB_RTO_MAX 4000
 #define CHALLENGE_BIN_LENGTH 32
 
+// Minimum number of public keys to keep ready for verification
+#define BOB_PUBKEYS_MAX 64
+
+// Sessions a reply from one address is checked against at most
+#define BOB_VERIFY_CANDIDATES 4
+
+// Maximum size of a DER encoded signature
+#define SIGNATURE_MAX_LENGTH 200
+
+/*
+* Answering a challenge costs a signature, so challenges are rate limited
+* by the /24 (IPv4) or /64 (IPv6) prefix of the sender and overall.
+* Excess challenges are dropped. Signatures are cached for a short time
+* to answer retransmitted challenges without signing again.
+*/
+#define BOB_RATE_PREFIXES 64
+#define BOB_RATE_PREFIX_PROBES 4
+#define BOB_PREFIX_TOKENS 10
+#define BOB_PREFIX_RATE 2
+#define BOB_SIGN_TOKENS 200
+#define BOB_SIGN_RATE 100
+
+// Maximum number of signatures queued for the workers
+#define BOB_SIGN_PENDING_MAX 64
+
+#define BOB_SIGNATURES_CACHE 64
+#define BOB_SIGNATURES_LIFETIME 10
+
 
 struct key_t {
 	struct key_t *next;
+	struct key_t *hash_next;
 	char *path; // File path the key was loaded from
+	uint8_t x[ECPARAMS_SIZE]; // X value of the public key
 	mbedtls_pk_context ctx_sign;
 };
 
+// Decompressed public key of a query
+struct pubkey_t {
+	uint8_t x[ECPARAMS_SIZE];
+	uint8_t q[1 + 2 * ECPARAMS_SIZE]; // 0x04|X|Y
+	time_t used;
+	int refs; // Resources using this key
+	int valid; // Holds a decompressed key
+};
+
+// A challenge sent to a result, free if query is empty
 struct bob_resource {
-	mbedtls_pk_context ctx_verify;
+	struct bob_resource *next; // Next in hash chain or free list
+	struct pubkey_t *pubkey;
 	uint8_t challenge[32];
 	uint8_t challenges_send;
+	uint64_t send_time; // Time the last challenge was sent (ms)
+	uint32_t rto; // Time to wait for a reply (ms)
+	unsigned int generation; // Changes on every start, to detect reuse
 	char query[QUERY_MAX_SIZE];
 	IP addr;
 };
 
+// Contexts owned by a worker thread, the DRBG reseeds from its own entropy
+struct bob_worker {
+	mbedtls_ecdsa_context ctx;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context drbg;
+};
+
+// Rate limit of challenges from a network prefix
+struct rate_prefix {
+	uint8_t prefix[8];
+	int len; // Prefix length in bytes, 0 if unused
+	time_t time; // Time of last refill
+	int tokens;
+	unsigned long drops;
+};
+
+// Recently sent signature
+struct signature_t {
+	uint8_t x[ECPARAMS_SIZE];
+	uint8_t challenge[CHALLENGE_BIN_LENGTH];
+	uint8_t sig[3 + SIGNATURE_MAX_LENGTH];
+	size_t slen;
+	time_t expire;
+};
+
+// Sign a received challenge
+struct sign_job {
+	int sock;
+	IP addr;
+	uint8_t x[ECPARAMS_SIZE]; // Public key
+	uint8_t d[ECPARAMS_SIZE]; // Secret key
+	uint8_t challenge[CHALLENGE_BIN_LENGTH];
+	uint8_t sig[3 + SIGNATURE_MAX_LENGTH];
+	size_t slen;
+	int ret;
+};
+
+// Verify a received reply against the sessions of the sender
+struct verify_job {
+	IP addr;
+	uint8_t sig[SIGNATURE_MAX_LENGTH];
+	size_t slen;
+	uint64_t recv_time;
+	int ok; // Index of the verified candidate or -1
+	int num;
+	struct {
+		struct bob_resource *resource;
+		unsigned int generation;
+		uint8_t q[1 + 2 * ECPARAMS_SIZE];
+		uint8_t challenge[CHALLENGE_BIN_LENGTH];
+	} candidates[BOB_VERIFY_CANDIDATES];
+};
+
 static int g_dht_socket = -1;
 static struct key_t *g_keys = NULL;
-static time_t g_send_challenges = 0;
-static struct bob_resource g_bob_resources[8];
 
-static mbedtls_entropy_context g_entropy;
-static mbedtls_ctr_drbg_context g_ctr_drbg;
+// Hash table of secret keys by X value of the public key
+static struct key_t **g_keys_table = NULL;
+static int g_keys_table_size = 0;
+static int g_keys_num = 0;
+
+// Sessions of --bob-sessions size, indexed by address
+static struct bob_resource *g_bob_resources = NULL;
+static struct bob_resource **g_bob_index = NULL;
+static struct bob_resource *g_bob_free = NULL;
+static int g_bob_resources_num = 0;
+static int g_bob_index_size = 0;
+
+// Time the next challenge needs to be retransmitted (ms)
+static uint64_t g_send_challenges = 0;
+
+// Smoothed round-trip time and variation of replies (ms), see RFC 6298
+static uint32_t g_srtt = 0;
+static uint32_t g_rttvar = 0;
+
+static struct pubkey_t *g_pubkeys = NULL;
+static int g_pubkeys_num = 0;
+
+// Curve to decompress public keys on the main thread
+static mbedtls_ecp_group g_grp;
+
+static struct bob_worker *g_workers = NULL;
+static int g_workers_num = 0;
+
+static struct rate_prefix g_rate_prefixes[BOB_RATE_PREFIXES];
+static unsigned long g_rate_prefix_drops = 0;
+static time_t g_sign_time = 0;
+static int g_sign_tokens = BOB_SIGN_TOKENS;
+static unsigned long g_sign_drops = 0;
+static int g_sign_pending = 0;
+
+static struct signature_t g_signatures[BOB_SIGNATURES_CACHE];
+static unsigned long g_signatures_hits = 0;
 
 
 // Decompress key since mbedtls does not have this feature.
@@ -154,12 +293,138 @@ cleanup:
 	return(ret);
 }
 
+// Get public key of a query, decompress only keys that are not cached
+static struct pubkey_t *bob_get_pubkey(const char query[])
+{
+	uint8_t compressed[33]; // 0x02|X
+	struct pubkey_t *pubkey;
+	size_t olen;
+	int ret;
+	int i;
+
+	// Hex to binary and compressed form (assuming even Y => 0x02)
+	compressed[0] = 0x02;
+
+	if (0 != bytes_from_base32hex(compressed + 1, sizeof(compressed) - 1, query, strlen(query))) {
+		log_error("BOB: Unexpected query length: %s", query);
+		return NULL;
+	}
+
+	// Find cached key or the least recently used unused entry
+	pubkey = NULL;
+	for (i = 0; i < g_pubkeys_num; i++) {
+		if (g_pubkeys[i].valid && memcmp(g_pubkeys[i].x, compressed + 1, ECPARAMS_SIZE) == 0) {
+			g_pubkeys[i].used = time_now_sec();
+			return &g_pubkeys[i];
+		}
+
+		if (g_pubkeys[i].refs == 0 && (pubkey == NULL || g_pubkeys[i].used < pubkey->used)) {
+			pubkey = &g_pubkeys[i];
+		}
+	}
+
+	if (pubkey == NULL) {
+		log_error("BOB: No free public key entry");
+		return NULL;
+	}
+
+	pubkey->valid = 0;
+
+	// Compressed form to decompressed, read into Q by the workers
+	if ((ret = mbedtls_ecp_decompress(
+			&g_grp, compressed, sizeof(compressed),
+			pubkey->q, &olen, sizeof(pubkey->q))) != 0) {
+		log_error("Error in mbedtls_ecp_decompress: %d\n", ret);
+		return NULL;
+	}
+
+	memcpy(pubkey->x, compressed + 1, ECPARAMS_SIZE);
+	pubkey->used = time_now_sec();
+	pubkey->valid = 1;
+
+	return pubkey;
+}
+
+// FNV-1a over address and port
+static int bob_addr_slot(const IP *addr)
+{
+	const uint8_t *bytes;
+	uint32_t hash = 2166136261U;
+	size_t len;
+	size_t i;
+
+	if (addr->ss_family == AF_INET6) {
+		bytes = (const uint8_t *) &((const IP6 *) addr)->sin6_addr;
+		len = 16;
+		hash = (hash ^ ((const IP6 *) addr)->sin6_port) * 16777619U;
+	} else {
+		bytes = (const uint8_t *) &((const IP4 *) addr)->sin_addr;
+		len = 4;
+		hash = (hash ^ ((const IP4 *) addr)->sin_port) * 16777619U;
+	}
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ bytes[i]) * 16777619U;
+	}
+
+	return hash & (g_bob_index_size - 1);
+}
+
+static void bob_index_remove(struct bob_resource *resource)
+{
+	struct bob_resource **cur;
+
+	cur = &g_bob_index[bob_addr_slot(&resource->addr)];
+	while (*cur) {
+		if (*cur == resource) {
+			*cur = resource->next;
+			break;
+		}
+		cur = &(*cur)->next;
+	}
+}
+
+// Current retransmission timeout
+static uint32_t bob_rto(void)
+{
+	if (g_srtt == 0) {
+		return BOB_RTO_INITIAL;
+	}
+
+	return MAX(BOB_RTO_MIN, MIN(BOB_RTO_MAX, g_srtt + 4 * g_rttvar));
+}
+
+static void bob_update_rtt(uint32_t rtt)
+{
+	uint32_t delta;
+
+	if (g_srtt == 0) {
+		g_srtt = rtt;
+		g_rttvar = rtt / 2;
+	} else {
+		delta = (g_srtt > rtt) ? (g_srtt - rtt) : (rtt - g_srtt);
+		g_rttvar = (3 * g_rttvar + delta) / 4;
+		g_srtt = (7 * g_srtt + rtt) / 8;
+	}
+}
+
 void bob_auth_end(struct bob_resource *resource, int state)
 {
 	// Set state of result
 	searches_set_auth_state(&resource->query[0], &resource->addr, state);
 
+	// Release public key
+	if (resource->pubkey) {
+		resource->pubkey->refs -= 1;
+		resource->pubkey = NULL;
+	}
+
 	// Mark resource as free
+	if (resource->query[0] != '\0') {
+		bob_index_remove(resource);
+		resource->next = g_bob_free;
+		g_bob_free = resource;
+	}
 	resource->query[0] = '\0';
 
 	// Look for next job
@@ -181,18 +446,18 @@ int bob_get_id(uint8_t id[], size_t idlen, const char query[])
 	return EXIT_FAILURE;
 }
 
-// Find a resource instance that is currently not in use
+// Take a resource instance that is currently not in use
 static struct bob_resource *bob_next_resource(void)
 {
-	int i;
+	struct bob_resource *resource;
 
-	for (i = 0; i < ARRAY_SIZE(g_bob_resources); i++) {
-		if (g_bob_resources[i].query[0] == '\0') {
-			return &g_bob_resources[i];
-		}
+	resource = g_bob_free;
+	if (resource) {
+		g_bob_free = resource->next;
+		resource->next = NULL;
 	}
 
-	return NULL;
+	return resource;
 }
 
 static void bob_send_challenge(int sock, struct bob_resource *resource)
@@ -206,12 +471,23 @@ static void bob_send_challenge(int sock, struct bob_resource *resource)
 	memcpy(buf, "BOB", 3);
 
 	// Append X value of public key
-	mbedtls_mpi_write_binary(&mbedtls_pk_ec(resource->ctx_verify)->Q.X, buf + 3, ECPARAMS_SIZE);
+	memcpy(buf + 3, resource->pubkey->x, ECPARAMS_SIZE);
 
 	// Append challenge bytes
 	memcpy(buf + 3 + ECPARAMS_SIZE, resource->challenge, CHALLENGE_BIN_LENGTH);
 
 	resource->challenges_send += 1;
+	resource->send_time = time_now_ms();
+
+	// Next retransmission, back off after a loss
+	if (resource->challenges_send > 1) {
+		resource->rto = MIN(2 * resource->rto, BOB_RTO_MAX);
+	}
+
+	if (g_send_challenges == 0 || (resource->send_time + resource->rto) < g_send_challenges) {
+		g_send_challenges = resource->send_time + resource->rto;
+	}
+
 	log_debug("Send challenge to %s: %s (try %d)",
 		str_addr(&resource->addr),
 		bytes_to_base32hex(hexbuf, sizeof(hexbuf), buf, sizeof(buf)),
@@ -221,57 +497,39 @@ static void bob_send_challenge(int sock, struct bob_resource *resource)
 	sendto(sock, buf, sizeof(buf), 0, (struct sockaddr*) &resource->addr, sizeof(IP));
 }
 
-// Start auth procedure for result bucket and utilize all resources
+// Start auth procedure for all results waiting and utilize all resources
 void bob_trigger_auth(void)
 {
-	uint8_t compressed[33]; // 0x02|X
-	uint8_t decompressed[65]; // 0x04|X|Y
-	size_t olen;
 	struct bob_resource *resource;
 	struct result_t *result;
-	int ret;
-
-	resource = bob_next_resource();
-	if (resource == NULL) {
-		return;
-	}
-
-	// Shortcuts
-	mbedtls_ecp_keypair *kp = mbedtls_pk_ec(resource->ctx_verify);
-	char *query = &resource->query[0];
-
-	// Find new query to authenticate and initialize resource
-	if ((result = searches_get_auth_target(query, &resource->addr, &bob_trigger_auth)) != NULL) {
-		result->state = AUTH_PROGRESS;
-
-		// Hex to binary and compressed form (assuming even Y => 0x02)
-		compressed[0] = 0x02;
-
-		if (0 != bytes_from_base32hex(compressed + 1, sizeof(compressed) - 1, query, strlen(query))) {
-			log_error("BOB: Unexpected query length: %s", query);
-			bob_auth_end(resource, AUTH_ERROR);
+	int slot;
+
+	while ((resource = bob_next_resource()) != NULL) {
+		// Find new query to authenticate and initialize resource
+		result = searches_get_auth_target(&resource->query[0], &resource->addr, &bob_trigger_auth);
+		if (result == NULL) {
+			resource->query[0] = '\0';
+			resource->next = g_bob_free;
+			g_bob_free = resource;
 			return;
 		}
 
-		// Compressed form to decompressed
-		if ((ret = mbedtls_ecp_decompress(
-				&kp->grp, compressed, sizeof(compressed),
-				decompressed, &olen, sizeof(decompressed))) != 0) {
-			log_error("Error in mbedtls_ecp_decompress: %d\n", ret);
-			bob_auth_end(resource, AUTH_ERROR);
-			return;
-		}
+		result->state = AUTH_PROGRESS;
+
+		slot = bob_addr_slot(&resource->addr);
+		resource->next = g_bob_index[slot];
+		g_bob_index[slot] = resource;
 
-		// Decompressed form to Q
-		if ((ret = mbedtls_ecp_point_read_binary(
-				&kp->grp, &kp->Q,
-				decompressed, sizeof(decompressed))) != 0) {
-			log_error("Error in mbedtls_ecp_point_read_binary: %d\n", ret);
+		resource->pubkey = bob_get_pubkey(&resource->query[0]);
+		if (resource->pubkey == NULL) {
 			bob_auth_end(resource, AUTH_ERROR);
 			return;
 		}
+		resource->pubkey->refs += 1;
 
 		resource->challenges_send = 0;
+		resource->rto = bob_rto();
+		resource->generation += 1;
 		bytes_random(resource->challenge, CHALLENGE_BIN_LENGTH);
 		bob_send_challenge(g_dht_socket, resource);
 	}
@@ -371,6 +629,55 @@ int bob_create_key(const char path[])
 	return 0;
 }
 
+// The X value is random already
+static int key_slot(const uint8_t x[], int size)
+{
+	uint32_t hash;
+
+	memcpy(&hash, x, sizeof(hash));
+
+	return hash & (size - 1);
+}
+
+static int key_insert(struct key_t *entry)
+{
+	struct key_t **table;
+	struct key_t *cur;
+	struct key_t *next;
+	int size;
+	int i;
+
+	// Grow and rehash when the load factor exceeds 1
+	if (g_keys_num >= g_keys_table_size) {
+		size = g_keys_table_size ? (2 * g_keys_table_size) : 16;
+		table = (struct key_t**) calloc(size, sizeof(struct key_t*));
+		if (table == NULL) {
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < g_keys_table_size; i++) {
+			cur = g_keys_table[i];
+			while (cur) {
+				next = cur->hash_next;
+				cur->hash_next = table[key_slot(cur->x, size)];
+				table[key_slot(cur->x, size)] = cur;
+				cur = next;
+			}
+		}
+
+		free(g_keys_table);
+		g_keys_table = table;
+		g_keys_table_size = size;
+	}
+
+	i = key_slot(entry->x, g_keys_table_size);
+	entry->hash_next = g_keys_table[i];
+	g_keys_table[i] = entry;
+	g_keys_num += 1;
+
+	return EXIT_SUCCESS;
+}
+
 // Add secret key
 int bob_load_key(const char path[])
 {
@@ -398,6 +705,12 @@ int bob_load_key(const char path[])
 	struct key_t *entry = (struct key_t*) calloc(1, sizeof(struct key_t));
 	memcpy(&entry->ctx_sign, &ctx, sizeof(ctx));
 	entry->path = strdup(path);
+	mbedtls_mpi_write_binary(&mbedtls_pk_ec(ctx)->Q.X, entry->x, ECPARAMS_SIZE);
+
+	if (key_insert(entry) != EXIT_SUCCESS) {
+		log_error("Failed to add key %s", path);
+		return -1;
+	}
 
 	// Prepend to list
 	if (g_keys) {
@@ -410,20 +723,28 @@ int bob_load_key(const char path[])
 	return 0;
 }
 
-// Send challenges
+// Retransmit challenges without reply
 void bob_send_challenges(int sock)
 {
 	struct bob_resource *resource;
+	uint64_t now;
 	int i;
 
-	// Send one packet per request
-	for (i = 0; i < ARRAY_SIZE(g_bob_resources); ++i) {
+	now = time_now_ms();
+	g_send_challenges = 0;
+
+	for (i = 0; i < g_bob_resources_num; ++i) {
 		resource = &g_bob_resources[i];
 		if (resource->query[0] == '\0') {
 			continue;
 		}
 
-		if (resource->challenges_send < MAX_AUTH_CHALLENGE_SEND) {
+		if (now < (resource->send_time + resource->rto)) {
+			// Not yet due
+			if (g_send_challenges == 0 || (resource->send_time + resource->rto) < g_send_challenges) {
+				g_send_challenges = resource->send_time + resource->rto;
+			}
+		} else if (resource->challenges_send < MAX_AUTH_CHALLENGE_SEND) {
 			bob_send_challenge(sock, resource);
 		} else {
 			bob_auth_end(resource, AUTH_ERROR);
@@ -431,81 +752,339 @@ void bob_send_challenges(int sock)
 	}
 }
 
-struct bob_resource *bob_find_resource(const IP *addr)
+static void bob_verify_work(void *data, int id)
 {
+	struct verify_job *job = (struct verify_job*) data;
+	mbedtls_ecdsa_context *ctx = &g_workers[id].ctx;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(g_bob_resources); ++i) {
-		if (addr_equal(&g_bob_resources[i].addr, addr)) {
-			return &g_bob_resources[i];
+	for (i = 0; i < job->num; i++) {
+		if (mbedtls_ecp_point_read_binary(&ctx->grp, &ctx->Q,
+				job->candidates[i].q, sizeof(job->candidates[i].q)) != 0) {
+			continue;
+		}
+
+		if (mbedtls_ecdsa_read_signature(ctx, job->candidates[i].challenge,
+				CHALLENGE_BIN_LENGTH, job->sig, job->slen) == 0) {
+			job->ok = i;
+			break;
 		}
 	}
+}
 
-	return NULL;
+static void bob_verify_done(void *data)
+{
+	struct verify_job *job = (struct verify_job*) data;
+	struct bob_resource *resource;
+	int i;
+
+	for (i = 0; i < job->num; i++) {
+		resource = job->candidates[i].resource;
+
+		// Session ended or was reused in the meantime
+		if (resource->query[0] == '\0' || resource->generation != job->candidates[i].generation) {
+			continue;
+		}
+
+		if (job->ok == i) {
+			// Retransmitted challenges give no usable sample
+			if (resource->challenges_send == 1) {
+				bob_update_rtt(job->recv_time - resource->send_time);
+				searches_set_rtt(resource->query, &resource->addr, job->recv_time - resource->send_time);
+			}
+			bob_auth_end(resource, AUTH_OK);
+			break;
+		}
+
+		if (job->ok < 0) {
+			bob_auth_end(resource, AUTH_FAILED);
+			break;
+		}
+	}
+
+	free(job);
 }
 
 // Receive a solved challenge and verify it
 void bob_verify_challenge(int sock, uint8_t buf[], size_t buflen, IP *addr)
 {
 	struct bob_resource *resource;
-	int ret;
+	struct verify_job *job;
 
-	resource = bob_find_resource(addr);
+	if ((buflen - 3) > SIGNATURE_MAX_LENGTH) {
+		log_warning("BOB: Invalid reply from %s", str_addr(addr));
+		return;
+	}
 
-	if (resource) {
-		ret = mbedtls_ecdsa_read_signature(mbedtls_pk_ec(resource->ctx_verify),
-			resource->challenge, CHALLENGE_BIN_LENGTH, buf + 3, buflen - 3);
+	job = (struct verify_job*) calloc(1, sizeof(struct verify_job));
+	if (job == NULL) {
+		return;
+	}
 
-		bob_auth_end(resource, ret ? AUTH_FAILED : AUTH_OK);
-	} else {
+	memcpy(&job->addr, addr, sizeof(IP));
+	memcpy(job->sig, buf + 3, buflen - 3);
+	job->slen = buflen - 3;
+	job->recv_time = time_now_ms();
+	job->ok = -1;
+
+	// More than one query might wait for a reply from the same address
+	resource = g_bob_index[bob_addr_slot(addr)];
+	while (resource && job->num < BOB_VERIFY_CANDIDATES) {
+		if (addr_equal(&resource->addr, addr)) {
+			job->candidates[job->num].resource = resource;
+			job->candidates[job->num].generation = resource->generation;
+			memcpy(job->candidates[job->num].q, resource->pubkey->q, sizeof(resource->pubkey->q));
+			memcpy(job->candidates[job->num].challenge, resource->challenge, CHALLENGE_BIN_LENGTH);
+			job->num += 1;
+		}
+		resource = resource->next;
+	}
+
+	if (job->num == 0) {
 		log_warning("BOB: No session found for address %s", str_addr(addr));
+		free(job);
+		return;
+	}
+
+	if (workers_submit(&bob_verify_work, &bob_verify_done, job) != EXIT_SUCCESS) {
+		free(job);
 	}
 }
 
 struct key_t *bob_find_key(const uint8_t pkey[])
 {
-	uint8_t epkey[ECPARAMS_SIZE];
-	struct key_t *key = g_keys;
+	struct key_t *key;
+
+	if (g_keys_table_size == 0) {
+		return NULL;
+	}
 
+	key = g_keys_table[key_slot(pkey, g_keys_table_size)];
 	while (key) {
-		mbedtls_mpi_write_binary(&mbedtls_pk_ec(key->ctx_sign)->Q.X, epkey, ECPARAMS_SIZE);
-		if (memcmp(epkey, pkey, ECPARAMS_SIZE) == 0) {
+		if (memcmp(key->x, pkey, ECPARAMS_SIZE) == 0) {
 			return key;
 		}
-		key = key->next;
+		key = key->hash_next;
 	}
 
-	return key;
+	return NULL;
+}
+
+static void bob_sign_work(void *data, int id)
+{
+	struct sign_job *job = (struct sign_job*) data;
+	struct bob_worker *worker = &g_workers[id];
+
+	job->ret = mbedtls_mpi_read_binary(&worker->ctx.d, job->d, sizeof(job->d));
+	if (job->ret == 0) {
+		job->ret = mbedtls_ecdsa_write_signature(
+			&worker->ctx, MBEDTLS_MD_SHA256,
+			job->challenge, CHALLENGE_BIN_LENGTH,
+			job->sig + 3, &job->slen, mbedtls_ctr_drbg_random, &worker->drbg);
+	}
+
+	// Also zeroes the private key in memory
+	mbedtls_mpi_free(&worker->ctx.d);
+}
+
+// FNV-1a
+static int signature_slot(const uint8_t x[], const uint8_t challenge[])
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < ECPARAMS_SIZE; i++) {
+		hash = (hash ^ x[i]) * 16777619U;
+	}
+
+	for (i = 0; i < CHALLENGE_BIN_LENGTH; i++) {
+		hash = (hash ^ challenge[i]) * 16777619U;
+	}
+
+	return hash % BOB_SIGNATURES_CACHE;
+}
+
+static struct signature_t *bob_find_signature(const uint8_t x[], const uint8_t challenge[])
+{
+	struct signature_t *signature;
+
+	signature = &g_signatures[signature_slot(x, challenge)];
+	if (signature->expire > time_now_sec()
+			&& memcmp(signature->x, x, ECPARAMS_SIZE) == 0
+			&& memcmp(signature->challenge, challenge, CHALLENGE_BIN_LENGTH) == 0) {
+		return signature;
+	}
+
+	return NULL;
+}
+
+static struct rate_prefix *bob_find_rate_prefix(const IP *addr)
+{
+	struct rate_prefix *rp;
+	struct rate_prefix *victim;
+	const uint8_t *ip;
+	uint32_t hash;
+	int len;
+	int i;
+
+	if (addr->ss_family == AF_INET) {
+		ip = (const uint8_t*) &((const IP4*) addr)->sin_addr;
+		len = 3;
+	} else {
+		ip = (const uint8_t*) &((const IP6*) addr)->sin6_addr;
+		len = 8;
+	}
+
+	// FNV-1a
+	hash = 2166136261U;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ ip[i]) * 16777619U;
+	}
+
+	// Prefer unused slots, then the least recently refilled prefix
+	victim = NULL;
+	for (i = 0; i < BOB_RATE_PREFIX_PROBES; i++) {
+		rp = &g_rate_prefixes[(hash + i) % BOB_RATE_PREFIXES];
+		if (rp->len == len && memcmp(rp->prefix, ip, len) == 0) {
+			return rp;
+		}
+
+		if (victim == NULL || (victim->len != 0 && (rp->len == 0 || rp->time < victim->time))) {
+			victim = rp;
+		}
+	}
+
+	memset(victim, 0, sizeof(struct rate_prefix));
+	memcpy(victim->prefix, ip, len);
+	victim->len = len;
+	victim->time = time_now_sec();
+	victim->tokens = BOB_PREFIX_TOKENS;
+
+	return victim;
+}
+
+// Check if the sender prefix may get another response
+static int bob_prefix_allowed(const IP *addr)
+{
+	struct rate_prefix *rp;
+	time_t now;
+
+	now = time_now_sec();
+	rp = bob_find_rate_prefix(addr);
+
+	if (rp->time < now) {
+		rp->tokens = MIN(BOB_PREFIX_TOKENS, rp->tokens + BOB_PREFIX_RATE * (now - rp->time));
+		rp->time = now;
+	}
+
+	if (rp->tokens == 0) {
+		rp->drops += 1;
+		g_rate_prefix_drops += 1;
+		return 0;
+	}
+
+	rp->tokens -= 1;
+
+	return 1;
+}
+
+// Check if another signature can be computed
+static int bob_sign_allowed(void)
+{
+	time_t now;
+
+	now = time_now_sec();
+
+	if (g_sign_time < now) {
+		g_sign_tokens = MIN(BOB_SIGN_TOKENS, g_sign_tokens + BOB_SIGN_RATE * (now - g_sign_time));
+		g_sign_time = now;
+	}
+
+	if (g_sign_tokens == 0 || g_sign_pending >= BOB_SIGN_PENDING_MAX) {
+		g_sign_drops += 1;
+		return 0;
+	}
+
+	g_sign_tokens -= 1;
+
+	return 1;
+}
+
+static void bob_sign_done(void *data)
+{
+	struct sign_job *job = (struct sign_job*) data;
+	struct signature_t *signature;
+
+	g_sign_pending -= 1;
+
+	if (job->ret != 0) {
+		log_warning("mbedtls_ecdsa_write_signature returned %d\n", job->ret);
+	} else {
+		log_debug("Received challenge from %s and send back response", str_addr(&job->addr));
+		memcpy(job->sig, "BOB", 3);
+		sendto(job->sock, job->sig, job->slen + 3, 0, (struct sockaddr*) &job->addr, sizeof(IP));
+
+		// Answer retransmissions from the cache
+		signature = &g_signatures[signature_slot(job->x, job->challenge)];
+		memcpy(signature->x, job->x, ECPARAMS_SIZE);
+		memcpy(signature->challenge, job->challenge, CHALLENGE_BIN_LENGTH);
+		memcpy(signature->sig, job->sig, job->slen + 3);
+		signature->slen = job->slen + 3;
+		signature->expire = time_add_secs(BOB_SIGNATURES_LIFETIME);
+	}
+
+	mbedtls_platform_zeroize(job, sizeof(struct sign_job));
+	free(job);
 }
 
 // Receive a challenge and solve it using a secret key
 void bob_encrypt_challenge(int sock, uint8_t buf[], size_t buflen, IP *addr)
 {
+	struct signature_t *signature;
+	struct sign_job *job;
 	struct key_t *key;
-	uint8_t sig[200];
 #ifdef DEBUG
 	char hexbuf[52 + 1];
 #endif
-	size_t slen;
-	int ret;
 
 	uint8_t *pkey = buf + 3;
 	uint8_t *challenge = buf + 3 + ECPARAMS_SIZE;
 
 	key = bob_find_key(pkey);
 	if (key) {
-		memcpy(sig, "BOB", 3);
-		ret = mbedtls_ecdsa_write_signature(
-			mbedtls_pk_ec(key->ctx_sign), MBEDTLS_MD_SHA256,
-			challenge, CHALLENGE_BIN_LENGTH,
-			sig + 3, &slen, mbedtls_ctr_drbg_random, &g_ctr_drbg);
-		slen += 3;
-
-		if (ret != 0) {
-			log_warning("mbedtls_ecdsa_write_signature returned %d\n", ret);
-		} else {
-			log_debug("Received challenge from %s and send back response", str_addr(addr));
-			sendto(sock, sig, slen, 0, (struct sockaddr*) addr, sizeof(IP));
+		if (!bob_prefix_allowed(addr)) {
+			return;
+		}
+
+		signature = bob_find_signature(pkey, challenge);
+		if (signature) {
+			log_debug("Received challenge from %s and send back cached response", str_addr(addr));
+			sendto(sock, signature->sig, signature->slen, 0, (struct sockaddr*) addr, sizeof(IP));
+			g_signatures_hits += 1;
+			return;
+		}
+
+		if (!bob_sign_allowed()) {
+			return;
+		}
+
+		job = (struct sign_job*) calloc(1, sizeof(struct sign_job));
+		if (job == NULL) {
+			return;
+		}
+
+		job->sock = sock;
+		memcpy(&job->addr, addr, sizeof(IP));
+		memcpy(job->x, pkey, ECPARAMS_SIZE);
+		memcpy(job->challenge, challenge, CHALLENGE_BIN_LENGTH);
+		mbedtls_mpi_write_binary(&mbedtls_pk_ec(key->ctx_sign)->d, job->d, sizeof(job->d));
+
+		g_sign_pending += 1;
+
+		if (workers_submit(&bob_sign_work, &bob_sign_done, job) != EXIT_SUCCESS) {
+			g_sign_pending -= 1;
+			mbedtls_platform_zeroize(job, sizeof(struct sign_job));
+			free(job);
 		}
 	} else {
 		log_debug("BOB: Secret key not found for public key: %s",
@@ -516,8 +1095,6 @@ void bob_encrypt_challenge(int sock, uint8_t buf[], size_t buflen, IP *addr)
 
 int bob_handler(int fd, uint8_t buf[], uint32_t buflen, IP *from)
 {
-	time_t now;
-
 	// Hack to get the DHT socket..
 	if (g_dht_socket == -1) {
 		g_dht_socket = fd;
@@ -534,11 +1111,8 @@ int bob_handler(int fd, uint8_t buf[], uint32_t buflen, IP *from)
 		return 0;
 	}
 
-	now = time_add_secs(0);
-
-	// Send out new challenges every second
-	if (g_send_challenges < now) {
-		g_send_challenges = now + 1;
+	// Retransmit challenges that are due
+	if (g_send_challenges && g_send_challenges <= time_now_ms()) {
 		bob_send_challenges(fd);
 	}
 
@@ -559,31 +1133,74 @@ void bob_debug_keys(FILE *fp)
 		fprintf(fp, "Public key: %s (%s)\n", get_pkey_base32hex(&key->ctx_sign), key->path);
 		key = key->next;
 	}
+
+	fprintf(fp, "Challenges: %lu dropped by prefix, %lu dropped overall, %lu answered from cache\n",
+		g_rate_prefix_drops, g_sign_drops, g_signatures_hits);
 }
 
 int bob_setup(void)
 {
-	struct bob_resource *resource;
 	struct key_t *key;
+	const char *pers = MAIN_SRVNAME;
 	const char *hkey;
+	int ret;
 	int i;
 
-	mbedtls_ctr_drbg_init(&g_ctr_drbg);
-	mbedtls_entropy_init(&g_entropy);
+	mbedtls_ecp_group_init(&g_grp);
+	mbedtls_ecp_group_load(&g_grp, ECPARAMS);
 
-	// Initialize resources handlers ctx_verify value
-	for (i = 0; i < ARRAY_SIZE(g_bob_resources); ++i) {
-		resource = &g_bob_resources[i];
-		mbedtls_pk_setup(&resource->ctx_verify, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
-		mbedtls_ecp_group_load(&mbedtls_pk_ec(resource->ctx_verify)->grp, ECPARAMS);
+	// Each worker has its own contexts
+	g_workers_num = workers_count();
+	g_workers = (struct bob_worker*) calloc(g_workers_num, sizeof(struct bob_worker));
+	if (g_workers == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < g_workers_num; ++i) {
+		mbedtls_ecdsa_init(&g_workers[i].ctx);
+		mbedtls_ecp_group_load(&g_workers[i].ctx.grp, ECPARAMS);
+		mbedtls_entropy_init(&g_workers[i].entropy);
+		mbedtls_ctr_drbg_init(&g_workers[i].drbg);
+
+		if ((ret = mbedtls_ctr_drbg_seed(&g_workers[i].drbg, mbedtls_entropy_func, &g_workers[i].entropy,
+				(const unsigned char *) pers, strlen(pers))) != 0) {
+			log_error("BOB: mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+			return EXIT_FAILURE;
+		}
+	}
+
+	g_bob_resources_num = gconf->bob_sessions;
+	g_bob_index_size = 1;
+	while (g_bob_index_size < g_bob_resources_num) {
+		g_bob_index_size *= 2;
+	}
+
+	// Every session may hold a different key
+	g_pubkeys_num = MAX(BOB_PUBKEYS_MAX, g_bob_resources_num);
+
+	g_bob_resources = (struct bob_resource*) calloc(g_bob_resources_num, sizeof(struct bob_resource));
+	g_bob_index = (struct bob_resource**) calloc(g_bob_index_size, sizeof(struct bob_resource*));
+	g_pubkeys = (struct pubkey_t*) calloc(g_pubkeys_num, sizeof(struct pubkey_t));
+
+	if (g_bob_resources == NULL || g_bob_index == NULL || g_pubkeys == NULL) {
+		log_error("BOB: Failed to allocate %d sessions", g_bob_resources_num);
+		return EXIT_FAILURE;
 	}
 
+	for (i = g_bob_resources_num - 1; i >= 0; i--) {
+		g_bob_resources[i].next = g_bob_free;
+		g_bob_free = &g_bob_resources[i];
+	}
+
+	// Challenges are cheap, send them to all results at once
+	searches_set_auth_race(&bob_trigger_auth, 0);
+
 	// Anounce keys via DHT
 	key = g_keys;
 	while (key) {
 		// Start announcing public key for the entire runtime
 		hkey = get_pkey_base32hex(&key->ctx_sign);
-		announces_add(hkey, gconf->dht_port, LONG_MAX);
+		announces_add(hkey, gconf->dht_port, LONG_MAX, ANNOUNCES_SOURCE_OTHER);
 		key = key->next;
 	}
 
@@ -594,9 +1211,30 @@ void bob_free(void)
 {
 	struct key_t *key;
 	struct key_t *next;
+	int i;
 
-	mbedtls_ctr_drbg_free(&g_ctr_drbg);
-	mbedtls_entropy_free(&g_entropy);
+	for (i = 0; i < g_workers_num; ++i) {
+		mbedtls_ecdsa_free(&g_workers[i].ctx);
+		mbedtls_ctr_drbg_free(&g_workers[i].drbg);
+		mbedtls_entropy_free(&g_workers[i].entropy);
+	}
+
+	free(g_workers);
+	g_workers = NULL;
+	g_workers_num = 0;
+
+	mbedtls_ecp_group_free(&g_grp);
+
+	free(g_pubkeys);
+	free(g_bob_resources);
+	free(g_bob_index);
+	g_pubkeys = NULL;
+	g_bob_resources = NULL;
+	g_bob_index = NULL;
+	g_bob_free = NULL;
+	g_pubkeys_num = 0;
+	g_bob_resources_num = 0;
+	g_bob_index_size = 0;
 
 	key = g_keys;
 	while (key) {
@@ -608,4 +1246,9 @@ void bob_free(void)
 		key = next;
 	}
 	g_keys = NULL;
+
+	free(g_keys_table);
+	g_keys_table = NULL;
+	g_keys_table_size = 0;
+	g_keys_num = 0;
 }
@@ -4,6 +4,9 @@
 
 #include <stdio.h>
 
+// Default number of BOB verifications at the same time
+#define BOB_SESSIONS_DEFAULT 64
+
 // Decide if the query is meant to be authorized via BOB
 int bob_get_id(uint8_t id[], size_t ilen, const char query[]);
 void bob_trigger_auth(void);
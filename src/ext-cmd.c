@@ -19,12 +19,16 @@
 #include "unix.h"
 #include "announces.h"
 #include "searches.h"
+#include "blacklist.h"
 #ifdef BOB
 #include "ext-bob.h"
 #endif
 #ifdef FWD
 #include "ext-fwd.h"
 #endif
+#ifdef LPD
+#include "ext-lpd.h"
+#endif
 #include "ext-cmd.h"
 
 
@@ -45,12 +49,15 @@ static const char* g_server_usage =
 
 const char* g_server_usage_debug =
 	"	blacklist <addr>\n"
-	"	list blacklist|searches|announcements|nodes"
+	"	list blacklist|ratelimit|searches|announcements|nodes"
 #ifdef FWD
 	"|forwardings"
 #endif
 #ifdef BOB
 	"|keys"
+#endif
+#ifdef LPD
+	"|lpd"
 #endif
 	"|constants\n"
 	"	list dht_buckets|dht_searches|dht_storage\n";
@@ -81,7 +88,8 @@ static void cmd_blacklist(FILE *fp, const char *addr_str)
 {
 	IP addr;
 
-	if (addr_parse(&addr, addr_str, NULL, gconf->af) == 0) {
+	// Without a port, all ports of the address are blacklisted
+	if (addr_parse_full(&addr, addr_str, "0", gconf->af) == 0) {
 		kad_blacklist(&addr);
 		fprintf(fp, "Added to blacklist: %s\n", str_addr(&addr));
 	} else {
@@ -175,11 +183,13 @@ static void cmd_exec(FILE *fp, const char request[], int allow_debug)
 		cmd_announce(fp, hostname, 0, minutes);
 	} else if (sscanf(request, "announce %255[^: ]:%d %d %c", hostname, &port, &minutes, &d) == 3) {
 		cmd_announce(fp, hostname, port, minutes);
+	} else if (sscanf(request, "blacklist %255s %c", hostname, &d) == 1 && allow_debug) {
+		cmd_blacklist(fp, hostname);
 	} else if (match(request, " list %*s %n") && allow_debug) {
-		if (sscanf(request, "blacklist %255[^: ]", hostname) == 1) {
-			cmd_blacklist(fp, hostname);
-		} else if (match(request, " list blacklist %n")) {
-			kad_debug_blacklist(fp);
+		if (match(request, " list blacklist %n")) {
+			blacklist_debug(fp);
+		} else if (match(request, " list ratelimit %n")) {
+			kad_debug_ratelimit(fp);
 		} else if (match(request, " list constants %n")) {
 			kad_debug_constants(fp);
 		} else if (match(request, " list nodes %n")) {
@@ -192,6 +202,10 @@ static void cmd_exec(FILE *fp, const char request[], int allow_debug)
 		} else if (match(request, " list forwardings %n")) {
 			fwd_debug(fp);
 #endif
+#ifdef LPD
+		} else if (match(request, " list lpd %n")) {
+			lpd_debug(fp);
+#endif
 #ifdef BOB
 		} else if (match(request, " list keys %n")) {
 			bob_debug_keys(fp);
@@ -23,29 +23,122 @@ enum {
 	// Packets per minute to be handled
 	PACKET_LIMIT_MAX = 20,
 	// Limit multicast message to the same subnet
-	TTL_SAME_SUBNET = 1
+	TTL_SAME_SUBNET = 1,
+	// Send discovery messages in this interval (seconds)
+	MCAST_INTERVAL = 5 * 60,
+	// Minimum time between discovery messages (seconds)
+	MCAST_MIN_INTERVAL = 10,
+	// Forget peers that were not seen for some discovery intervals
+	PEER_LIFETIME = 3 * MCAST_INTERVAL + 60
 };
 
+// A peer found in the local network
+struct lpd_peer {
+	IP addr;
+	time_t seen;
+};
+
+static struct lpd_peer g_peers[LPD_PEERS_MAX];
+static int g_peers_num = 0;
+
 struct LPD_STATE {
 	IP mcast_addr;
 	time_t mcast_time;
+	time_t mcast_last;
+	time_t limit_time;
 	int packet_limit;
 	int sock_send;
 	int sock_listen;
 };
 
 struct LPD_STATE g_lpd4 = {
-	.mcast_addr = { 0 }, .mcast_time = 0,
+	.mcast_addr = { 0 }, .mcast_time = 0, .mcast_last = 0, .limit_time = 0,
 	.packet_limit = PACKET_LIMIT_MAX,
 	.sock_send = -1, .sock_listen = -1
 };
 
 struct LPD_STATE g_lpd6 = {
-	.mcast_addr = { 0 }, .mcast_time = 0,
+	.mcast_addr = { 0 }, .mcast_time = 0, .mcast_last = 0, .limit_time = 0,
 	.packet_limit = PACKET_LIMIT_MAX,
 	.sock_send = -1, .sock_listen = -1
 };
 
+// Add or refresh a peer, return 1 if the peer is new
+static int lpd_add_peer(const IP *addr)
+{
+	struct lpd_peer *oldest;
+	int i;
+
+	oldest = &g_peers[0];
+	for (i = 0; i < g_peers_num; i++) {
+		if (addr_equal(&g_peers[i].addr, addr)) {
+			g_peers[i].seen = time_now_sec();
+			return 0;
+		}
+		if (g_peers[i].seen < oldest->seen) {
+			oldest = &g_peers[i];
+		}
+	}
+
+	// Replace the least recently seen peer if full
+	if (g_peers_num < LPD_PEERS_MAX) {
+		oldest = &g_peers[g_peers_num];
+		g_peers_num += 1;
+	}
+
+	memcpy(&oldest->addr, addr, sizeof(IP));
+	oldest->seen = time_now_sec();
+
+	return 1;
+}
+
+int lpd_get_peers(IP addrs[], int addrs_num)
+{
+	time_t now;
+	int num;
+	int i;
+
+	now = time_now_sec();
+	num = 0;
+	for (i = 0; i < g_peers_num && num < addrs_num; i++) {
+		if ((g_peers[i].seen + PEER_LIFETIME) > now) {
+			memcpy(&addrs[num], &g_peers[i].addr, sizeof(IP));
+			num += 1;
+		}
+	}
+
+	return num;
+}
+
+void lpd_debug(FILE *fp)
+{
+	time_t now;
+	int count;
+	int i;
+
+	now = time_now_sec();
+	count = 0;
+	for (i = 0; i < g_peers_num; i++) {
+		if ((g_peers[i].seen + PEER_LIFETIME) > now) {
+			fprintf(fp, " %s (seen %ld sec ago)\n", str_addr(&g_peers[i].addr), now - g_peers[i].seen);
+			count += 1;
+		}
+	}
+
+	fprintf(fp, " Found %d local peers.\n", count);
+}
+
+static void send_mcast(struct LPD_STATE* lpd)
+{
+	char buf[16];
+
+	log_debug("LPD: Send discovery message to %s", str_addr(&lpd->mcast_addr));
+	sprintf(buf, "DHT %d", gconf->dht_port);
+	sendto(lpd->sock_send, (void const*) buf, strlen(buf), 0, (struct sockaddr const*) &lpd->mcast_addr, addr_len(&lpd->mcast_addr));
+
+	lpd->mcast_last = time_now_sec();
+}
+
 static void handle_mcast(int rc, struct LPD_STATE* lpd)
 {
 	char buf[16];
@@ -53,19 +146,18 @@ static void handle_mcast(int rc, struct LPD_STATE* lpd)
 	uint16_t port;
 	IP addr;
 
-	if (lpd->mcast_time <= time_now_sec()) {
-		// No peers known, send multicast
-		if (kad_count_nodes(0) == 0) {
-			log_debug("LPD: Send discovery message to %s", str_addr(&lpd->mcast_addr));
-			sprintf(buf, "DHT %d", gconf->dht_port);
-			sendto(lpd->sock_send, (void const*) buf, strlen(buf), 0, (struct sockaddr const*) &lpd->mcast_addr, addr_len(&lpd->mcast_addr));
-		}
-
-		// Cap number of received packets to 10 per minute
+	if (lpd->limit_time <= time_now_sec()) {
+		// Cap number of received packets to 20 per minute
 		lpd->packet_limit = 5 * PACKET_LIMIT_MAX;
+		lpd->limit_time = time_add_mins(5);
+	}
+
+	if (lpd->mcast_time <= time_now_sec()) {
+		// Let other peers know about us
+		send_mcast(lpd);
 
-		// Try again in ~5 minutes
-		lpd->mcast_time = time_add_mins(5);
+		// Try again in ~5 minutes, or in a minute if no peers are known
+		lpd->mcast_time = (kad_count_nodes(0) == 0) ? time_add_mins(1) : time_add_secs(MCAST_INTERVAL);
 	}
 
 	if (rc <= 0) {
@@ -89,7 +181,11 @@ static void handle_mcast(int rc, struct LPD_STATE* lpd)
 
 	if (sscanf(buf, "DHT %hu", &port) == 1) {
 		port_set(&addr, port);
-		log_debug("LPD: Ping lonely peer at %s", str_addr(&addr));
+		if (lpd_add_peer(&addr)) {
+			log_debug("LPD: Found local peer at %s", str_addr(&addr));
+			// Let the new peer know about us soon, but rate limit
+			lpd->mcast_time = MIN(lpd->mcast_time, MAX(time_now_sec(), lpd->mcast_last + MCAST_MIN_INTERVAL));
+		}
 		kad_ping(&addr);
 	}
 }
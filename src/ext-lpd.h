@@ -3,8 +3,9 @@
 #define _LPD_H
 
 /*
-* Send multicast messages to discover
-* new nodes if no other nodes are known.
+* Send multicast messages to discover nodes in the local
+* network. Discovered nodes are kept as a separate set of
+* local peers that lookups can ask directly.
 */
 
 #include <stdio.h>
@@ -12,7 +13,15 @@
 #include <string.h>
 
 
+// Maximum number of local peers to remember
+#define LPD_PEERS_MAX 32
+
 int lpd_setup(void);
 void lpd_free(void);
 
+// Get addresses of local peers that were seen recently
+int lpd_get_peers(IP addrs[], int addrs_num);
+
+void lpd_debug(FILE *fp);
+
 #endif // _LPD_H
@@ -7,6 +7,9 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
 
 #include "mbedtls/config.h"
 #include "mbedtls/platform.h"
@@ -27,31 +30,132 @@
 #include "kad.h"
 #include "net.h"
 #include "searches.h"
+#include "workers.h"
 #include "ext-tls-client.h"
 
 
+// Abort connections that take longer (seconds)
+#define TLS_CLIENT_TIMEOUT 5
+
+// Maximum number of cached sessions for resumption
+#define TLS_CLIENT_SESSIONS_MAX 64
+
+// Resume sessions only for this long (seconds)
+#define TLS_CLIENT_SESSION_LIFETIME (60 * 60)
+
 // SSL structures for parallel connection handling.
 struct tls_resource {
 	mbedtls_ssl_context ssl;
 	mbedtls_net_context fdc;
 	char query[QUERY_MAX_SIZE];
 	IP addr;
+	time_t start_time;
+	uint64_t connect_time; // Time connect() was called (ms)
+	int connected; // TCP connection established
+	int busy; // Handshake step runs on a worker
+	int abort; // Another connection won while busy
+};
+
+// Configuration owned by a worker thread, all are equal but for the random generator
+struct tls_worker {
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context drbg;
+	mbedtls_ssl_config conf;
+};
+
+// Handshake step of a connection, run on a worker
+struct handshake_job {
+	struct tls_resource *resource;
+	int ret;
+};
+
+// Session of a successful handshake to resume on re-authentication
+struct tls_session {
+	char query[QUERY_MAX_SIZE];
+	IP addr;
+	mbedtls_ssl_session session;
+	time_t expire;
 };
 
 // Global TLS resources
 static mbedtls_x509_crt g_cacert;
-static mbedtls_entropy_context g_entropy;
-static mbedtls_ctr_drbg_context g_drbg;
-static mbedtls_ssl_config g_conf;
+static struct tls_worker *g_workers = NULL;
+static int g_workers_num = 0;
 static int g_client_enable = 0;
 
-// Allow two parallel authentications at once
-static struct tls_resource g_tls_resources[2];
+// Pool of resources for parallel authentications
+static struct tls_resource *g_tls_resources = NULL;
+static int g_tls_resources_num = 0;
+
+// Sessions by query and address
+static struct tls_session g_tls_sessions[TLS_CLIENT_SESSIONS_MAX];
+
+
+static struct tls_session *tls_session_find(const char query[], const IP *addr)
+{
+	struct tls_session *entry;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(g_tls_sessions); ++i) {
+		entry = &g_tls_sessions[i];
+		if (entry->expire > time_now_sec()
+				&& addr_equal(&entry->addr, addr)
+				&& strcmp(entry->query, query) == 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static void tls_session_remove(const char query[], const IP *addr)
+{
+	struct tls_session *entry;
+
+	entry = tls_session_find(query, addr);
+	if (entry) {
+		mbedtls_ssl_session_free(&entry->session);
+		mbedtls_ssl_session_init(&entry->session);
+		entry->expire = 0;
+	}
+}
+
+// Remember the session of a verified connection
+static void tls_session_save(const mbedtls_ssl_context *ssl, const char query[], const IP *addr)
+{
+	struct tls_session *entry;
+	int i;
+
+	entry = tls_session_find(query, addr);
+
+	// Replace the entry that expires first
+	if (entry == NULL) {
+		entry = &g_tls_sessions[0];
+		for (i = 1; i < ARRAY_SIZE(g_tls_sessions); ++i) {
+			if (g_tls_sessions[i].expire < entry->expire) {
+				entry = &g_tls_sessions[i];
+			}
+		}
+	}
+
+	mbedtls_ssl_session_free(&entry->session);
+	mbedtls_ssl_session_init(&entry->session);
+
+	if (mbedtls_ssl_get_session(ssl, &entry->session) != 0) {
+		entry->expire = 0;
+		return;
+	}
+
+	snprintf(entry->query, sizeof(entry->query), "%s", query);
+	memcpy(&entry->addr, addr, sizeof(IP));
+	entry->expire = time_now_sec() + TLS_CLIENT_SESSION_LIFETIME;
+}
 
 
 // Start TLS connection
 static int tls_connect_init(mbedtls_ssl_context *ssl, mbedtls_net_context *fdc, const char query[], const IP *addr)
 {
+	struct tls_session *session;
 	int ret;
 
 	mbedtls_ssl_set_bio(ssl, fdc, mbedtls_net_send, mbedtls_net_recv, NULL);
@@ -61,6 +165,12 @@ static int tls_connect_init(mbedtls_ssl_context *ssl, mbedtls_net_context *fdc,
 		return EXIT_FAILURE;
 	}
 
+	// Skip the full handshake if we verified this peer before
+	session = tls_session_find(query, addr);
+	if (session && mbedtls_ssl_set_session(ssl, &session->session) == 0) {
+		log_debug("TLS-Client: Resume session with %s: %s", str_addr(addr), query);
+	}
+
 	fdc->fd = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
 	if (fdc->fd < 0) {
 		log_error("TLS-Client: Socket creation failed: %s", strerror(errno));
@@ -70,6 +180,8 @@ static int tls_connect_init(mbedtls_ssl_context *ssl, mbedtls_net_context *fdc,
 	ret = mbedtls_net_set_nonblock(fdc);
 	if (ret < 0) {
 		log_error("TLS-Client: Failed to set socket non-blocking: %s", strerror(errno));
+		mbedtls_net_free(fdc);
+		mbedtls_net_init(fdc);
 		return EXIT_FAILURE;
 	}
 
@@ -90,7 +202,7 @@ static struct tls_resource *tls_find_resource(int fd)
 {
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(g_tls_resources); ++i) {
+	for (i = 0; i < g_tls_resources_num; ++i) {
 		if (g_tls_resources[i].fdc.fd == fd) {
 			return &g_tls_resources[i];
 		}
@@ -103,7 +215,7 @@ static struct tls_resource *tls_find_resource(int fd)
 // Forward declaration
 static void tls_handle(int rc, int fd);
 
-static void auth_end(struct tls_resource* resource, int state)
+static void tls_close(struct tls_resource* resource)
 {
 	int ret;
 
@@ -118,49 +230,98 @@ static void auth_end(struct tls_resource* resource, int state)
 
 	// Mark resource as free
 	mbedtls_net_init(&resource->fdc);
+}
+
+static void auth_end(struct tls_resource* resource, int state)
+{
+	struct tls_resource *other;
+	int i;
+
+	tls_close(resource);
 
 	// Set state of result
 	searches_set_auth_state(&resource->query[0], &resource->addr, state);
 
+	// First successful handshake wins, abort the other connections for this query
+	if (state == AUTH_OK) {
+		for (i = 0; i < g_tls_resources_num; ++i) {
+			other = &g_tls_resources[i];
+			if (other->fdc.fd >= 0 && strcmp(other->query, resource->query) == 0) {
+				if (other->busy) {
+					// Closed when the worker is done
+					other->abort = 1;
+					continue;
+				}
+				log_debug("TLS-Client: Abort connection to %s: %s", str_addr(&other->addr), other->query);
+				tls_close(other);
+				searches_set_auth_state(&other->query[0], &other->addr, AUTH_SKIP);
+			}
+		}
+	}
+
 	// Look for next job
 	tls_client_trigger_auth();
 }
 
-static void tls_handle(int rc, int fd)
+// Time the peer certificate expires, unknown for resumed sessions
+static time_t tls_cert_expire(const mbedtls_ssl_context *ssl)
 {
-	struct tls_resource* resource;
-	mbedtls_ssl_context* ssl;
-	const char *query;
-	uint32_t flags;
-	int ret;
+	const mbedtls_x509_crt *crt;
+	struct tm tm;
 
-	resource = tls_find_resource(fd);
-	if (resource == NULL) {
-		// Should not happen..
-		close(fd);
-		net_remove_handler(fd, &tls_handle);
-		return;
+	crt = mbedtls_ssl_get_peer_cert(ssl);
+	if (crt == NULL) {
+		return LONG_MAX;
 	}
 
-	ssl = &resource->ssl;
-	query = &resource->query[0];
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = crt->valid_to.year - 1900;
+	tm.tm_mon = crt->valid_to.mon - 1;
+	tm.tm_mday = crt->valid_to.day;
+	tm.tm_hour = crt->valid_to.hour;
+	tm.tm_min = crt->valid_to.min;
+	tm.tm_sec = crt->valid_to.sec;
 
-	if (rc < 0) {
-		if (errno != EINPROGRESS) {
-			// Failed to create TCP/IP connection.
-			log_warning("TLS-Client: Socket error for '%s': %s", query, strerror(errno));
-			auth_end(resource, AUTH_ERROR);
-		} else {
-			// Still connecting.
-		}
+	return timegm(&tm);
+}
+
+static void tls_handshake_work(void *data, int id)
+{
+	struct handshake_job *job = (struct handshake_job*) data;
+	mbedtls_ssl_context *ssl = &job->resource->ssl;
+
+	// Use the random generator of this thread
+	ssl->conf = &g_workers[id].conf;
+
+	do job->ret = mbedtls_ssl_handshake(ssl);
+	while (job->ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+}
+
+static void tls_handshake_done(void *data)
+{
+	struct handshake_job *job = (struct handshake_job*) data;
+	struct tls_resource *resource = job->resource;
+	mbedtls_ssl_context *ssl = &resource->ssl;
+	const char *query = &resource->query[0];
+	int ret = job->ret;
+	uint32_t flags;
+
+	free(job);
+
+	resource->busy = 0;
+
+	if (resource->abort) {
+		resource->abort = 0;
+		log_debug("TLS-Client: Abort connection to %s: %s", str_addr(&resource->addr), query);
+		tls_close(resource);
+		searches_set_auth_state(query, &resource->addr, AUTH_SKIP);
+		tls_client_trigger_auth();
 		return;
 	}
 
-	do ret = mbedtls_ssl_handshake(ssl);
-	while(ret == MBEDTLS_ERR_SSL_WANT_WRITE);
-
 	if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
-		// TLS handshake in progress
+		// TLS handshake in progress, wait for replies
+		net_set_events(resource->fdc.fd, &tls_handle, POLLIN);
 		return;
 	}
 
@@ -173,6 +334,9 @@ static void tls_handle(int rc, int fd)
 		}
 #endif
 
+		// Do not try to resume a session that failed
+		tls_session_remove(query, &resource->addr);
+
 		auth_end(resource, AUTH_FAILED);
 	} else {
 		// TLS handshake done
@@ -197,7 +361,75 @@ static void tls_handle(int rc, int fd)
 			log_debug("TLS-Client: Peer certificate information: %s", buf);
 		}
 #endif
-		auth_end(resource, flags == 0 ? AUTH_OK : AUTH_FAILED);
+		if (flags == 0) {
+			tls_session_save(ssl, query, &resource->addr);
+			searches_add_verified(query, &resource->addr, tls_cert_expire(ssl));
+			auth_end(resource, AUTH_OK);
+		} else {
+			tls_session_remove(query, &resource->addr);
+			auth_end(resource, AUTH_FAILED);
+		}
+	}
+}
+
+static void tls_handle(int rc, int fd)
+{
+	struct tls_resource* resource;
+	struct handshake_job *job;
+	const char *query;
+	socklen_t len;
+	int err = 0;
+
+	resource = tls_find_resource(fd);
+	if (resource == NULL) {
+		// Should not happen..
+		close(fd);
+		net_remove_handler(fd, &tls_handle);
+		return;
+	}
+
+	query = &resource->query[0];
+
+	// Wait for the socket to become writable, timeouts are checked in tls_client_handle()
+	if (!resource->connected) {
+		if (rc == 0) {
+			// Still connecting
+			return;
+		}
+
+		len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			// Failed to create TCP/IP connection
+			log_warning("TLS-Client: Socket error for '%s': %s", query, strerror(err ? err : errno));
+			auth_end(resource, AUTH_ERROR);
+			return;
+		}
+
+		// The TCP handshake takes one round-trip
+		searches_set_rtt(query, &resource->addr, time_now_ms() - resource->connect_time);
+
+		// Send the ClientHello now
+		resource->connected = 1;
+	} else if (rc == 0) {
+		return;
+	}
+
+	job = (struct handshake_job*) calloc(1, sizeof(struct handshake_job));
+	if (job == NULL) {
+		auth_end(resource, AUTH_ERROR);
+		return;
+	}
+
+	job->resource = resource;
+
+	// Do not poll the socket until the worker is done
+	resource->busy = 1;
+	net_set_events(fd, &tls_handle, 0);
+
+	if (workers_submit(&tls_handshake_work, &tls_handshake_done, job) != EXIT_SUCCESS) {
+		free(job);
+		resource->busy = 0;
+		auth_end(resource, AUTH_ERROR);
 	}
 }
 
@@ -227,7 +459,7 @@ static struct tls_resource *tls_next_resource(void)
 {
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(g_tls_resources); ++i) {
+	for (i = 0; i < g_tls_resources_num; ++i) {
 		if (g_tls_resources[i].fdc.fd < 0) {
 			return &g_tls_resources[i];
 		}
@@ -248,27 +480,48 @@ void tls_client_trigger_auth(void)
 		return;
 	}
 
-	// Get next free SSL resource
-	resource = tls_next_resource();
-	if (resource == NULL) {
-		return;
-	}
-
-	if ((result = searches_get_auth_target(
-			&resource->query[0], &resource->addr,
-			&tls_client_trigger_auth)) != NULL) {
+	// Start as many authentications as there are free SSL resources
+	while ((resource = tls_next_resource()) != NULL) {
+		result = searches_get_auth_target(&resource->query[0], &resource->addr, &tls_client_trigger_auth);
+		if (result == NULL) {
+			break;
+		}
 
+		resource->connect_time = time_now_ms();
 		if (EXIT_FAILURE == tls_connect_init(&resource->ssl, &resource->fdc, &resource->query[0], &result->addr)) {
-			// Failed to initiate connection
-			result->state = AUTH_ERROR;
+			// Failed to initiate connection, might end the search
+			mbedtls_ssl_session_reset(&resource->ssl);
+			searches_set_auth_state(&resource->query[0], &resource->addr, AUTH_ERROR);
 		} else {
-			// Start authentication process
+			// Start authentication process once connected
 			result->state = AUTH_PROGRESS;
+			resource->start_time = time_now_sec();
+			resource->connected = 0;
 			net_add_handler(resource->fdc.fd, &tls_handle);
+			net_set_events(resource->fdc.fd, &tls_handle, POLLOUT);
 		}
 	}
 }
 
+// Abort slow connections and start delayed authentications
+static void tls_client_handle(int _rc, int _fd)
+{
+	struct tls_resource *resource;
+	int i;
+
+	for (i = 0; i < g_tls_resources_num; ++i) {
+		resource = &g_tls_resources[i];
+		// A busy connection is checked again after the worker is done
+		if (resource->fdc.fd >= 0 && !resource->busy
+				&& (resource->start_time + TLS_CLIENT_TIMEOUT) <= time_now_sec()) {
+			log_debug("TLS-Client: Connection timed out for %s: %s", str_addr(&resource->addr), resource->query);
+			auth_end(resource, AUTH_ERROR);
+		}
+	}
+
+	tls_client_trigger_auth();
+}
+
 #if DEBUG
 
 // Verify configuration
@@ -315,10 +568,44 @@ int tls_client_add_ca(const char path[])
 	return EXIT_SUCCESS;
 }
 
-int tls_client_setup(void)
+static int tls_worker_setup(struct tls_worker *worker)
 {
 	const char *pers = "kadnode";
 	int ret;
+
+	if ((ret = mbedtls_ctr_drbg_seed(&worker->drbg, mbedtls_entropy_func, &worker->entropy,
+		(const unsigned char *) pers, strlen(pers))) != 0) {
+		log_error("TLS-Client: mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+		return EXIT_FAILURE;
+	}
+
+	// Setup SSL/TLS structure
+	if ((ret = mbedtls_ssl_config_defaults(&worker->conf,
+		MBEDTLS_SSL_IS_CLIENT,
+		MBEDTLS_SSL_TRANSPORT_STREAM,
+		MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+		log_error("TLS-Client: mbedtls_ssl_config_defaults returned -0x%x", -ret);
+		return EXIT_FAILURE;
+	}
+
+#ifdef DEBUG
+	mbedtls_ssl_conf_verify(&worker->conf, tls_conf_verify, NULL);
+#endif
+
+	mbedtls_ssl_conf_rng(&worker->conf, mbedtls_ctr_drbg_random, &worker->drbg);
+	mbedtls_ssl_conf_read_timeout(&worker->conf, 0);
+	mbedtls_ssl_conf_ca_chain(&worker->conf, &g_cacert, NULL);
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	mbedtls_ssl_conf_session_tickets(&worker->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+	return EXIT_SUCCESS;
+}
+
+int tls_client_setup(void)
+{
+	int ret;
 	int i;
 
 	// Reject query if TLS client disabled
@@ -333,47 +620,53 @@ int tls_client_setup(void)
 
 	//mbedtls_debug_set_threshold(0);
 
-	mbedtls_ctr_drbg_init(&g_drbg);
-	mbedtls_entropy_init(&g_entropy);
-
-	if ((ret = mbedtls_ctr_drbg_seed(&g_drbg, mbedtls_entropy_func, &g_entropy,
-		(const unsigned char *) pers, strlen(pers))) != 0) {
-		log_error("TLS-Client: mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+	// Each worker has its own configuration
+	g_workers_num = workers_count();
+	g_workers = (struct tls_worker*) calloc(g_workers_num, sizeof(struct tls_worker));
+	if (g_workers == NULL) {
+		g_workers_num = 0;
 		return EXIT_FAILURE;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(g_tls_resources); ++i) {
-		mbedtls_ssl_init(&g_tls_resources[i].ssl);
-		mbedtls_net_init(&g_tls_resources[i].fdc);
+	for (i = 0; i < g_workers_num; ++i) {
+		mbedtls_entropy_init(&g_workers[i].entropy);
+		mbedtls_ctr_drbg_init(&g_workers[i].drbg);
+		mbedtls_ssl_config_init(&g_workers[i].conf);
 	}
 
-	mbedtls_ssl_config_init(&g_conf);
+	for (i = 0; i < g_workers_num; ++i) {
+		if (tls_worker_setup(&g_workers[i]) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
+	}
 
-	// Setup SSL/TLS structure
-	if ((ret = mbedtls_ssl_config_defaults(&g_conf,
-		MBEDTLS_SSL_IS_CLIENT,
-		MBEDTLS_SSL_TRANSPORT_STREAM,
-		MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
-		log_error("TLS-Client: mbedtls_ssl_config_defaults returned -0x%x", -ret);
+	g_tls_resources_num = gconf->tls_client_connections;
+	g_tls_resources = (struct tls_resource*) calloc(g_tls_resources_num, sizeof(struct tls_resource));
+	if (g_tls_resources == NULL) {
+		log_error("TLS-Client: Failed to allocate %d connections", g_tls_resources_num);
 		return EXIT_FAILURE;
 	}
 
-#ifdef DEBUG
-	mbedtls_ssl_conf_verify(&g_conf, tls_conf_verify, NULL);
-#endif
+	for (i = 0; i < g_tls_resources_num; ++i) {
+		mbedtls_ssl_init(&g_tls_resources[i].ssl);
+		mbedtls_net_init(&g_tls_resources[i].fdc);
+	}
 
-	mbedtls_ssl_conf_rng(&g_conf, mbedtls_ctr_drbg_random, &g_drbg);
-	mbedtls_ssl_conf_read_timeout(&g_conf, 0);
-	mbedtls_ssl_conf_ca_chain(&g_conf, &g_cacert, NULL);
+	for (i = 0; i < ARRAY_SIZE(g_tls_sessions); ++i) {
+		mbedtls_ssl_session_init(&g_tls_sessions[i].session);
+	}
 
-	// Initialize a bunch ob SSL contexts
-	for (i = 0; i < ARRAY_SIZE(g_tls_resources); ++i) {
-		if ((ret = mbedtls_ssl_setup(&g_tls_resources[i].ssl, &g_conf)) != 0) {
+	// Initialize a bunch ob SSL contexts, the workers replace the configuration
+	for (i = 0; i < g_tls_resources_num; ++i) {
+		if ((ret = mbedtls_ssl_setup(&g_tls_resources[i].ssl, &g_workers[0].conf)) != 0) {
 			log_error("TLS-Client: mbedtls_ssl_setup returned -0x%x", -ret);
 			return EXIT_SUCCESS;
 		}
 	}
 
+	// Cause the callback to be called in intervals
+	net_add_handler(-1, &tls_client_handle);
+
 	return EXIT_SUCCESS;
 }
 
@@ -381,13 +674,29 @@ void tls_client_free(void)
 {
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(g_tls_resources); ++i) {
+	for (i = 0; i < g_tls_resources_num; ++i) {
 		mbedtls_ssl_free(&g_tls_resources[i].ssl);
 		mbedtls_net_free(&g_tls_resources[i].fdc);
 	}
 
+	free(g_tls_resources);
+	g_tls_resources = NULL;
+	g_tls_resources_num = 0;
+
+	for (i = 0; i < ARRAY_SIZE(g_tls_sessions); ++i) {
+		mbedtls_ssl_session_free(&g_tls_sessions[i].session);
+	}
+	memset(g_tls_sessions, 0, sizeof(g_tls_sessions));
+
+	for (i = 0; i < g_workers_num; ++i) {
+		mbedtls_ssl_config_free(&g_workers[i].conf);
+		mbedtls_ctr_drbg_free(&g_workers[i].drbg);
+		mbedtls_entropy_free(&g_workers[i].entropy);
+	}
+
+	free(g_workers);
+	g_workers = NULL;
+	g_workers_num = 0;
+
 	mbedtls_x509_crt_free(&g_cacert);
-	mbedtls_ssl_config_free(&g_conf);
-	mbedtls_entropy_free(&g_entropy);
-	mbedtls_ctr_drbg_free(&g_drbg);
 }
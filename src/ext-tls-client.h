@@ -2,6 +2,8 @@
 #ifndef _EXT_TLS_CLIENT_H_
 #define _EXT_TLS_CLIENT_H_
 
+// Default number of TLS connections to verify results in parallel
+#define TLS_CLIENT_CONNECTIONS_DEFAULT 8
 
 // Add Certifiacte Authorities (CAs)
 int tls_client_add_ca(const char ca_path[]);
@@ -6,11 +6,15 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "mbedtls/config.h"
 #include "mbedtls/platform.h"
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/ssl.h"
+#include "mbedtls/ssl_ticket.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/certs.h"
@@ -26,58 +30,192 @@
 #include "kad.h"
 #include "net.h"
 #include "searches.h"
+#include "workers.h"
 #include "ext-tls-server.h"
 
 
 /*
 * TLS server that closes the connection as soon as the handshake has been done.
 * The certificates are selected by Server Name Indication (SNI).
+* Session tickets let clients that authenticate the same name again
+* skip the full handshake.
+* Handshakes run in parallel, each connection has its own SSL context.
+* The handshake steps run on the worker threads (see workers.h), each
+* worker has its own configuration and random generator.
 */
 
-static mbedtls_entropy_context g_entropy;
-static mbedtls_ctr_drbg_context g_drbg;
-static mbedtls_ssl_context g_ssl;
-static mbedtls_ssl_config g_conf;
+// Lifetime of session tickets (seconds)
+#define TLS_SERVER_SESSION_LIFETIME (60 * 60)
+
+// Maximum number of handshakes at the same time
+#define TLS_SERVER_CONNECTIONS_MAX 32
+
+// Maximum number of handshakes from the same address
+#define TLS_SERVER_CONNECTIONS_PER_ADDR 4
+
+// Abort handshakes that take longer (seconds)
+#define TLS_SERVER_TIMEOUT 5
+
+// A client connection
+struct tls_connection {
+	mbedtls_ssl_context ssl;
+	mbedtls_net_context fd;
+	uint8_t ip[16];
+	size_t ip_len;
+	time_t start_time;
+	int ready; // SSL context was set up
+	int busy; // Handshake step runs on a worker
+};
+
+// Configuration owned by a worker thread, all are equal but for the random generator
+struct tls_worker {
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context drbg;
+	mbedtls_ssl_config conf;
+};
+
+// Handshake step of a connection
+struct handshake_job {
+	struct tls_connection *connection;
+	int ret;
+};
+
+static struct tls_worker *g_workers = NULL;
+static int g_workers_num = 0;
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+// Ticket keys are shared by all workers, the mutex also guards the key rotation
+static mbedtls_entropy_context g_ticket_entropy;
+static mbedtls_ctr_drbg_context g_ticket_drbg;
+static mbedtls_ssl_ticket_context g_ticket;
+static pthread_mutex_t g_ticket_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 static mbedtls_net_context g_listen_fd4;
 static mbedtls_net_context g_listen_fd6;
-static mbedtls_net_context g_client_fd4;
-static mbedtls_net_context g_client_fd6;
 
+static struct tls_connection g_connections[TLS_SERVER_CONNECTIONS_MAX];
+static int g_connections_num = 0;
+
+// Listening sockets are polled, stopped while all connections are in use
+static int g_accepting = 0;
+
+
+// Private key, shared by all certificates loaded with the same key file
+struct sni_key {
+	char *path;
+	mbedtls_pk_context key;
+	struct sni_key *next;
+};
 
 // Certificate for each domain we authenticate
 struct sni_entry {
 	const char *name;
 	mbedtls_x509_crt crt;
-	mbedtls_pk_context key;
+	mbedtls_pk_context *key;
 	struct sni_entry *next;
+	struct sni_entry *hash_next;
 };
 
 static struct sni_entry *g_sni_entries = NULL;
+static struct sni_key *g_sni_keys = NULL;
 
+// Hash table of entries by name, wildcard entries by "*.<domain>"
+static struct sni_entry **g_sni_table = NULL;
+static int g_sni_table_size = 0;
+static int g_sni_entries_num = 0;
 
-// Forward declaration
+
+// Forward declarations
 static void tls_client_handler(int rc, int sock);
+static void tls_server_handler(int rc, int sock);
 
 
-static void end_client_connection(mbedtls_net_context *client_fd, int result)
+// Start or stop to accept new connections
+static void tls_server_accept(int enable)
+{
+	if (g_accepting == enable) {
+		return;
+	}
+
+	if (g_listen_fd4.fd > -1) {
+		if (enable) {
+			net_add_handler(g_listen_fd4.fd, &tls_server_handler);
+		} else {
+			net_remove_handler(g_listen_fd4.fd, &tls_server_handler);
+		}
+	}
+
+	if (g_listen_fd6.fd > -1) {
+		if (enable) {
+			net_add_handler(g_listen_fd6.fd, &tls_server_handler);
+		} else {
+			net_remove_handler(g_listen_fd6.fd, &tls_server_handler);
+		}
+	}
+
+	g_accepting = enable;
+}
+
+static struct tls_connection *tls_find_connection(int fd)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(g_connections); ++i) {
+		if (g_connections[i].fd.fd == fd) {
+			return &g_connections[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Count connections from the same address
+static int tls_count_connections(const uint8_t ip[], size_t ip_len)
+{
+	const struct tls_connection *connection;
+	int count;
+	int i;
+
+	count = 0;
+	for (i = 0; i < ARRAY_SIZE(g_connections); ++i) {
+		connection = &g_connections[i];
+		if (connection->fd.fd > -1 && connection->ip_len == ip_len
+				&& memcmp(connection->ip, ip, ip_len) == 0) {
+			count += 1;
+		}
+	}
+
+	return count;
+}
+
+static void end_client_connection(struct tls_connection *connection, int result)
 {
 	int ret;
 
-	net_remove_handler(client_fd->fd, tls_client_handler);
+	net_remove_handler(connection->fd.fd, &tls_client_handler);
 
 	// Done and close connection
-	do ret = mbedtls_ssl_close_notify(&g_ssl);
+	do ret = mbedtls_ssl_close_notify(&connection->ssl);
 	while (ret == MBEDTLS_ERR_SSL_WANT_WRITE);
 
-	mbedtls_net_free(client_fd);
-	mbedtls_ssl_session_reset(&g_ssl);
+	mbedtls_net_free(&connection->fd);
+	mbedtls_ssl_session_reset(&connection->ssl);
+
+	// Mark connection as free
+	mbedtls_net_init(&connection->fd);
+	g_connections_num -= 1;
+
+	// Accept connections again
+	tls_server_accept(1);
 
 #ifdef DEBUG
 	if (result == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED)  {
 		log_debug("TLS-Server: Hello verification requested");
 	} else if (result == MBEDTLS_ERR_SSL_CLIENT_RECONNECT) {
 		log_debug("TLS-Server: Client initiated reconnection from same port");
+	} else if (result == MBEDTLS_ERR_SSL_TIMEOUT) {
+		log_debug("TLS-Server: Handshake timed out");
 	} else if (result != 0) {
 		char error_buf[100];
 		mbedtls_strerror(result, error_buf, 100);
@@ -88,23 +226,33 @@ static void end_client_connection(mbedtls_net_context *client_fd, int result)
 #endif
 }
 
-static void tls_client_handler(int rc, int sock)
+static void tls_handshake_work(void *data, int id)
 {
-	mbedtls_net_context *client_fd;
-	int ret;
+	struct handshake_job *job = (struct handshake_job*) data;
+	mbedtls_ssl_context *ssl = &job->connection->ssl;
+
+	// Use the random generator of this thread
+	ssl->conf = &g_workers[id].conf;
+
+	do job->ret = mbedtls_ssl_handshake(ssl);
+	while (job->ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+}
+
+static void tls_handshake_done(void *data)
+{
+	struct handshake_job *job = (struct handshake_job*) data;
+	struct tls_connection *connection = job->connection;
+	mbedtls_ssl_context *ssl = &connection->ssl;
+	int ret = job->ret;
 	int exp;
 
-	if (sock == g_client_fd4.fd) {
-		client_fd = &g_client_fd4;
-	} else {
-		client_fd = &g_client_fd6;
-	}
+	free(job);
 
-	do ret = mbedtls_ssl_handshake(&g_ssl);
-	while (ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+	connection->busy = 0;
 
 	if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
-		// TLS handshake in progress
+		// TLS handshake in progress, wait for more data
+		net_set_events(connection->fd.fd, &tls_client_handler, POLLIN);
 		return;
 	}
 
@@ -112,69 +260,172 @@ static void tls_client_handler(int rc, int sock)
 #ifdef DEBUG
 		if (ret == MBEDTLS_ERR_X509_CERT_VERIFY_FAILED) {
 			char vrfy_buf[512];
-			int flags = mbedtls_ssl_get_verify_result(&g_ssl);
+			int flags = mbedtls_ssl_get_verify_result(ssl);
 			mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "", flags);
 
 			log_debug("TLS-Server: Verify failed: %s", vrfy_buf);
 		}
 #endif
-		end_client_connection(client_fd, ret);
+		end_client_connection(connection, ret);
 	} else {
 		log_debug("TLS-Server: Protocol is %s, ciphersuite is %s",
-			mbedtls_ssl_get_version(&g_ssl), mbedtls_ssl_get_ciphersuite(&g_ssl));
+			mbedtls_ssl_get_version(ssl), mbedtls_ssl_get_ciphersuite(ssl));
 
-		if ((exp = mbedtls_ssl_get_record_expansion(&g_ssl)) >= 0) {
+		if ((exp = mbedtls_ssl_get_record_expansion(ssl)) >= 0) {
 			log_debug("TLS-Server: Record expansion is %d", exp);
 		} else {
 			log_debug("TLS-Server: Record expansion is unknown (compression)");
 		}
 
 		// All ok
-		end_client_connection(client_fd, 0);
+		end_client_connection(connection, 0);
 	}
 }
 
+static void tls_client_handler(int rc, int sock)
+{
+	struct tls_connection *connection;
+	struct handshake_job *job;
+
+	connection = tls_find_connection(sock);
+	if (connection == NULL) {
+		// Should not happen..
+		close(sock);
+		net_remove_handler(sock, &tls_client_handler);
+		return;
+	}
+
+	// Timeouts are checked in tls_server_handle()
+	if (rc == 0) {
+		return;
+	}
+
+	job = (struct handshake_job*) calloc(1, sizeof(struct handshake_job));
+	if (job == NULL) {
+		end_client_connection(connection, MBEDTLS_ERR_SSL_ALLOC_FAILED);
+		return;
+	}
+
+	job->connection = connection;
+
+	// Do not poll the socket until the worker is done
+	connection->busy = 1;
+	net_set_events(sock, &tls_client_handler, 0);
+
+	if (workers_submit(&tls_handshake_work, &tls_handshake_done, job) != EXIT_SUCCESS) {
+		free(job);
+		connection->busy = 0;
+		end_client_connection(connection, MBEDTLS_ERR_SSL_ALLOC_FAILED);
+	}
+}
+
+// Find a connection that is currently not in use
+static struct tls_connection *tls_next_connection(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(g_connections); ++i) {
+		if (g_connections[i].fd.fd < 0) {
+			return &g_connections[i];
+		}
+	}
+
+	return NULL;
+}
+
 static void tls_server_handler(int rc, int sock)
 {
-	unsigned char client_ip[16] = { 0 };
+	struct tls_connection *connection;
 	mbedtls_net_context *listen_fd;
-	mbedtls_net_context *client_fd;
-	size_t cliip_len;
 	int ret;
 
-	if (rc <= 0 || g_client_fd4.fd > -1 || g_client_fd6.fd > -1) {
-		// No data or there is already a connection in progress
+	if (rc <= 0) {
+		// No data
 		return;
 	}
 
 	if (sock == g_listen_fd6.fd) {
 		listen_fd = &g_listen_fd6;
-		client_fd = &g_client_fd6;
 	} else {
 		listen_fd = &g_listen_fd4;
-		client_fd = &g_client_fd4;
 	}
 
-	if ((ret = mbedtls_net_accept(listen_fd, client_fd,
-				client_ip, sizeof(client_ip), &cliip_len)) != 0) {
-		log_warning("TLS-Server: mbedtls_net_accept returned -0x%x", -ret);
-		return;
-	}
+	// Accept all pending connections
+	while (1) {
+		connection = tls_next_connection();
+		if (connection == NULL) {
+			// Leave new connections in the backlog
+			log_debug("TLS-Server: All %d connections in use", (int) ARRAY_SIZE(g_connections));
+			tls_server_accept(0);
+			return;
+		}
 
-	log_debug("TLS-Server: Got incoming connection");
+		ret = mbedtls_net_accept(listen_fd, &connection->fd,
+			connection->ip, sizeof(connection->ip), &connection->ip_len);
 
-	ret = mbedtls_net_set_nonblock(client_fd);
-	if (ret != 0) {
-		log_warning("TLS-Server: net_set_nonblock() returned -0x%x", -ret);
-		return;
-	}
+		if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+			// No more connections
+			return;
+		}
+
+		if (ret != 0) {
+			log_warning("TLS-Server: mbedtls_net_accept returned -0x%x", -ret);
+			mbedtls_net_init(&connection->fd);
+			return;
+		}
+
+		// Limit connections from a single source
+		if (tls_count_connections(connection->ip, connection->ip_len) > TLS_SERVER_CONNECTIONS_PER_ADDR) {
+			log_debug("TLS-Server: Too many connections from the same address");
+			mbedtls_net_free(&connection->fd);
+			mbedtls_net_init(&connection->fd);
+			continue;
+		}
+
+		log_debug("TLS-Server: Got incoming connection");
+
+		ret = mbedtls_net_set_nonblock(&connection->fd);
+		if (ret != 0) {
+			log_warning("TLS-Server: net_set_nonblock() returned -0x%x", -ret);
+			mbedtls_net_free(&connection->fd);
+			mbedtls_net_init(&connection->fd);
+			continue;
+		}
 
-	mbedtls_ssl_conf_read_timeout(&g_conf, 0);
+		// Allocate SSL buffers on first use only, the workers replace the configuration
+		if (!connection->ready) {
+			if ((ret = mbedtls_ssl_setup(&connection->ssl, &g_workers[0].conf)) != 0) {
+				log_error("TLS-Server: mbedtls_ssl_setup returned -0x%x", -ret);
+				mbedtls_net_free(&connection->fd);
+				mbedtls_net_init(&connection->fd);
+				return;
+			}
+			connection->ready = 1;
+		}
 
-	mbedtls_ssl_set_bio(&g_ssl, client_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+		mbedtls_ssl_set_bio(&connection->ssl, &connection->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+		connection->start_time = time_now_sec();
+		g_connections_num += 1;
+
+		// New incoming handler connection
+		net_add_handler(connection->fd.fd, &tls_client_handler);
+	}
+}
 
-	// New incoming handler connection
-	net_add_handler(client_fd->fd, tls_client_handler);
+// Abort handshakes that take too long
+static void tls_server_handle(int _rc, int _sock)
+{
+	struct tls_connection *connection;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(g_connections); ++i) {
+		connection = &g_connections[i];
+		// A busy connection is checked again after the worker is done
+		if (connection->fd.fd > -1 && !connection->busy
+				&& (connection->start_time + TLS_SERVER_TIMEOUT) <= time_now_sec()) {
+			end_client_connection(connection, MBEDTLS_ERR_SSL_TIMEOUT);
+		}
+	}
 }
 
 // Get the CN field of an certificate
@@ -201,53 +452,173 @@ static int get_common_name(char buf[], size_t len, const mbedtls_x509_crt *crt)
 	return 1;
 }
 
-// Match common name with domain name
-static int match_pattern(const char cname[], const char name[])
+// FNV-1a
+static int sni_slot(const char name[], int size)
 {
-	if (cname[0] == '*') {
-		char *dot = strchr(name, '.');
-		return dot && (strcmp(dot, cname + 1) == 0);
-	} else {
-		return strcmp(cname, name) == 0;
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash = (hash ^ (uint8_t) *name++) * 16777619U;
+	}
+
+	return hash & (size - 1);
+}
+
+static struct sni_entry *sni_find(const char name[])
+{
+	struct sni_entry *entry;
+
+	if (g_sni_table_size == 0) {
+		return NULL;
 	}
+
+	entry = g_sni_table[sni_slot(name, g_sni_table_size)];
+	while (entry) {
+		if (strcmp(entry->name, name) == 0) {
+			return entry;
+		}
+		entry = entry->hash_next;
+	}
+
+	return NULL;
+}
+
+static int sni_insert(struct sni_entry *entry)
+{
+	struct sni_entry **table;
+	struct sni_entry *cur;
+	struct sni_entry *next;
+	int size;
+	int i;
+
+	// Grow and rehash when the load factor exceeds 1
+	if (g_sni_entries_num >= g_sni_table_size) {
+		size = g_sni_table_size ? (2 * g_sni_table_size) : 64;
+		table = (struct sni_entry**) calloc(size, sizeof(struct sni_entry*));
+		if (table == NULL) {
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < g_sni_table_size; i++) {
+			cur = g_sni_table[i];
+			while (cur) {
+				next = cur->hash_next;
+				cur->hash_next = table[sni_slot(cur->name, size)];
+				table[sni_slot(cur->name, size)] = cur;
+				cur = next;
+			}
+		}
+
+		free(g_sni_table);
+		g_sni_table = table;
+		g_sni_table_size = size;
+	}
+
+	i = sni_slot(entry->name, g_sni_table_size);
+	entry->hash_next = g_sni_table[i];
+	g_sni_table[i] = entry;
+	g_sni_entries_num += 1;
+
+	return EXIT_SUCCESS;
+}
+
+// Find certificate for the exact name or a wildcard for the parent domain
+static struct sni_entry *sni_match(const char name[])
+{
+	char pattern[QUERY_MAX_SIZE];
+	struct sni_entry *entry;
+	const char *dot;
+
+	entry = sni_find(name);
+	if (entry) {
+		return entry;
+	}
+
+	// A wildcard only matches the first label
+	dot = strchr(name, '.');
+	if (dot && snprintf(pattern, sizeof(pattern), "*%s", dot) < sizeof(pattern)) {
+		return sni_find(pattern);
+	}
+
+	return NULL;
 }
 
 // SNI callback. The client submits the domain it is looking for.
 // The proper certificate needs to be selected and returned.
 static int sni_callback(void *p_info, mbedtls_ssl_context *ssl, const unsigned char *name, size_t name_len)
 {
-	struct sni_entry *cur;
+	char buf[QUERY_MAX_SIZE];
+	struct sni_entry *entry;
 
-	log_debug("TLS-Server: Lookup certificate for domain: %s", name);
+	// The name is not null terminated
+	if (name_len >= sizeof(buf)) {
+		return -1;
+	}
 
-	cur = (struct sni_entry *) p_info;
-	while (cur != NULL) {
-		if (match_pattern(cur->name, (const char*) name)) {
-			// The client does not need to be authenticated
-			mbedtls_ssl_set_hs_authmode(ssl, MBEDTLS_SSL_VERIFY_NONE);
+	memcpy(buf, name, name_len);
+	buf[name_len] = '\0';
 
-			// Set own certificate and key for the current handshake
-			return(mbedtls_ssl_set_hs_own_cert(ssl, &cur->crt, &cur->key));
-		}
+	log_debug("TLS-Server: Lookup certificate for domain: %s", buf);
+
+	entry = sni_match(buf);
+	if (entry == NULL) {
+		return -1;
+	}
 
+	// The client does not need to be authenticated
+	mbedtls_ssl_set_hs_authmode(ssl, MBEDTLS_SSL_VERIFY_NONE);
+
+	// Set own certificate and key for the current handshake
+	return mbedtls_ssl_set_hs_own_cert(ssl, &entry->crt, entry->key);
+}
+
+// Parse a key file only once
+static mbedtls_pk_context *sni_load_key(const char key_file[])
+{
+	char error_buf[100];
+	struct sni_key *cur;
+	int ret;
+
+	cur = g_sni_keys;
+	while (cur) {
+		if (strcmp(cur->path, key_file) == 0) {
+			return &cur->key;
+		}
 		cur = cur->next;
 	}
 
-	return -1;
+	if ((cur = calloc(1, sizeof(struct sni_key))) == NULL) {
+		log_error("TLS-Server: Error calling calloc()");
+		return NULL;
+	}
+
+	mbedtls_pk_init(&cur->key);
+
+	if ((ret = mbedtls_pk_parse_keyfile(&cur->key, key_file, "" /* no password */)) != 0) {
+		mbedtls_strerror(ret, error_buf, sizeof(error_buf));
+		log_error("TLS-Server: %s: %s", key_file, error_buf);
+		mbedtls_pk_free(&cur->key);
+		free(cur);
+		return NULL;
+	}
+
+	cur->path = strdup(key_file);
+	cur->next = g_sni_keys;
+	g_sni_keys = cur;
+
+	return &cur->key;
 }
 
 int tls_server_add_sni(const char crt_file[], const char key_file[])
 {
 	char error_buf[100];
 	mbedtls_x509_crt crt;
-	mbedtls_pk_context key;
+	mbedtls_pk_context *key;
 	struct sni_entry *new;
-	struct sni_entry *cur;
 	char name[QUERY_MAX_SIZE];
 	int ret;
 
 	mbedtls_x509_crt_init(&crt);
-	mbedtls_pk_init(&key);
 
 	if ((ret = mbedtls_x509_crt_parse_file(&crt, crt_file)) != 0) {
 		mbedtls_strerror(ret, error_buf, sizeof(error_buf));
@@ -255,9 +626,7 @@ int tls_server_add_sni(const char crt_file[], const char key_file[])
 		return EXIT_FAILURE;
 	}
 
-	if ((ret = mbedtls_pk_parse_keyfile(&key, key_file, "" /* no password */)) != 0) {
-		mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-		log_error("TLS-Server: %s: %s", key_file, error_buf);
+	if ((key = sni_load_key(key_file)) == NULL) {
 		return EXIT_FAILURE;
 	}
 
@@ -268,13 +637,9 @@ int tls_server_add_sni(const char crt_file[], const char key_file[])
 	}
 
 	// Check for duplicate entries
-	cur = g_sni_entries;
-	while (cur) {
-		if (strcmp(cur->name, name) == 0) {
-			log_error("TLS-Server: Duplicate entry %s", name);
-			return EXIT_FAILURE;
-		}
-		cur = cur->next;
+	if (sni_find(name)) {
+		log_error("TLS-Server: Duplicate entry %s", name);
+		return EXIT_FAILURE;
 	}
 
 	// Create new entry
@@ -284,9 +649,14 @@ int tls_server_add_sni(const char crt_file[], const char key_file[])
 	}
 
 	new->name = strdup(name);
-	memcpy(&new->key, &key, sizeof(key));
+	new->key = key;
 	memcpy(&new->crt, &crt, sizeof(crt));
 
+	if (sni_insert(new) != EXIT_SUCCESS) {
+		log_error("TLS-Server: Error calling calloc()");
+		return EXIT_FAILURE;
+	}
+
 #ifdef DEBUG
 	char buf[MBEDTLS_SSL_MAX_CONTENT_LEN];
 	mbedtls_x509_crt_info(buf, sizeof(buf), "  ", &new->crt);
@@ -294,9 +664,7 @@ int tls_server_add_sni(const char crt_file[], const char key_file[])
 #endif
 
 	// Prepend entry to list
-	if (g_sni_entries) {
-		new->next = g_sni_entries;
-	}
+	new->next = g_sni_entries;
 	g_sni_entries = new;
 
 	log_info("TLS-Server: Loaded server credentials for %s (%s, %s)", name, crt_file, key_file);
@@ -320,10 +688,71 @@ static void tls_announce_all_cnames(void)
 	}
 }
 
+#if defined(MBEDTLS_SSL_TICKET_C)
+static int tls_ticket_write(void *p_ticket, const mbedtls_ssl_session *session,
+	unsigned char *start, const unsigned char *end, size_t *tlen, uint32_t *lifetime)
+{
+	int ret;
+
+	pthread_mutex_lock(&g_ticket_mutex);
+	ret = mbedtls_ssl_ticket_write(p_ticket, session, start, end, tlen, lifetime);
+	pthread_mutex_unlock(&g_ticket_mutex);
+
+	return ret;
+}
+
+static int tls_ticket_parse(void *p_ticket, mbedtls_ssl_session *session, unsigned char *buf, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&g_ticket_mutex);
+	ret = mbedtls_ssl_ticket_parse(p_ticket, session, buf, len);
+	pthread_mutex_unlock(&g_ticket_mutex);
+
+	return ret;
+}
+#endif
+
+static int tls_worker_setup(struct tls_worker *worker)
+{
+	const char *pers = "kadnode";
+	int ret;
+
+	if ((ret = mbedtls_ctr_drbg_seed(&worker->drbg, mbedtls_entropy_func, &worker->entropy,
+		(const unsigned char *) pers, strlen(pers))) != 0) {
+		log_error("TLS-Server: mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+		return EXIT_FAILURE;
+	}
+
+	if ((ret = mbedtls_ssl_config_defaults(&worker->conf,
+		MBEDTLS_SSL_IS_SERVER,
+		MBEDTLS_SSL_TRANSPORT_STREAM,
+		MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+	{
+		log_error("TLS-Server: mbedtls_ssl_config_defaults returned -0x%x", -ret);
+		return EXIT_FAILURE;
+	}
+
+	mbedtls_ssl_conf_authmode(&worker->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+	mbedtls_ssl_conf_rng(&worker->conf, mbedtls_ctr_drbg_random, &worker->drbg);
+	mbedtls_ssl_conf_read_timeout(&worker->conf, 0);
+	//mbedtls_ssl_conf_dbg(&worker->conf, my_debug, stdout);
+
+	mbedtls_ssl_conf_sni(&worker->conf, sni_callback, NULL);
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+	// Resume sessions by ticket, the client keeps the state
+	mbedtls_ssl_conf_session_tickets_cb(&worker->conf, tls_ticket_write, tls_ticket_parse, &g_ticket);
+#endif
+
+	return EXIT_SUCCESS;
+}
+
 int tls_server_setup(void)
 {
 	const char *pers = "kadnode";
 	int ret;
+	int i;
 
 	// Without SNI entries, there is no reason to start the TLS server
 	if (g_sni_entries == NULL) {
@@ -331,65 +760,111 @@ int tls_server_setup(void)
 	}
 
 	// Initialize sockets
-	mbedtls_net_init(&g_client_fd4);
 	mbedtls_net_init(&g_listen_fd4);
-	mbedtls_net_init(&g_client_fd6);
 	mbedtls_net_init(&g_listen_fd6);
 
-	mbedtls_ssl_init(&g_ssl);
-	mbedtls_ssl_config_init(&g_conf);
-	mbedtls_ctr_drbg_init(&g_drbg);
+	for (i = 0; i < ARRAY_SIZE(g_connections); ++i) {
+		mbedtls_ssl_init(&g_connections[i].ssl);
+		mbedtls_net_init(&g_connections[i].fd);
+	}
+
+	// Each worker has its own configuration
+	g_workers_num = workers_count();
+	g_workers = (struct tls_worker*) calloc(g_workers_num, sizeof(struct tls_worker));
+	if (g_workers == NULL) {
+		g_workers_num = 0;
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < g_workers_num; ++i) {
+		mbedtls_entropy_init(&g_workers[i].entropy);
+		mbedtls_ctr_drbg_init(&g_workers[i].drbg);
+		mbedtls_ssl_config_init(&g_workers[i].conf);
+	}
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_entropy_init(&g_ticket_entropy);
+	mbedtls_ctr_drbg_init(&g_ticket_drbg);
+	mbedtls_ssl_ticket_init(&g_ticket);
+#endif
 
 	// Announce all common names from certificates
 	tls_announce_all_cnames();
 
 	//mbedtls_debug_set_threshold(0);
 
-	mbedtls_entropy_init(&g_entropy);
-	if ((ret = mbedtls_ctr_drbg_seed(&g_drbg, mbedtls_entropy_func, &g_entropy,
+#if defined(MBEDTLS_SSL_TICKET_C)
+	if ((ret = mbedtls_ctr_drbg_seed(&g_ticket_drbg, mbedtls_entropy_func, &g_ticket_entropy,
 		(const unsigned char *) pers, strlen(pers))) != 0) {
 		log_error("TLS-Server: mbedtls_ctr_drbg_seed returned -0x%x", -ret);
 		return EXIT_FAILURE;
 	}
 
-	// May return -1 if protocol not enabled/supported
-	g_listen_fd4.fd = net_bind("TLS", "0.0.0.0", gconf->dht_port, NULL, IPPROTO_TCP);
-	g_listen_fd6.fd = net_bind("TLS", "::", gconf->dht_port, NULL, IPPROTO_TCP);
-
-	if ((ret = mbedtls_ssl_config_defaults(&g_conf,
-		MBEDTLS_SSL_IS_SERVER,
-		MBEDTLS_SSL_TRANSPORT_STREAM,
-		MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
-	{
-		log_error("TLS-Server: mbedtls_ssl_config_defaults returned -0x%x", -ret);
+	// New keys are only generated within the ticket callbacks
+	if ((ret = mbedtls_ssl_ticket_setup(&g_ticket, mbedtls_ctr_drbg_random, &g_ticket_drbg,
+		MBEDTLS_CIPHER_AES_256_GCM, TLS_SERVER_SESSION_LIFETIME)) != 0) {
+		log_error("TLS-Server: mbedtls_ssl_ticket_setup returned -0x%x", -ret);
 		return EXIT_FAILURE;
 	}
+#endif
 
-	mbedtls_ssl_conf_authmode(&g_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-	mbedtls_ssl_conf_rng(&g_conf, mbedtls_ctr_drbg_random, &g_drbg);
-	//mbedtls_ssl_conf_dbg(&g_conf, my_debug, stdout);
-
-	mbedtls_ssl_conf_sni(&g_conf, sni_callback, g_sni_entries);
-
-	if ((ret = mbedtls_ssl_setup(&g_ssl, &g_conf)) != 0) {
-		log_error("TLS-Server: mbedtls_ssl_setup returned -0x%x", -ret);
-		return EXIT_FAILURE;
+	for (i = 0; i < g_workers_num; ++i) {
+		if (tls_worker_setup(&g_workers[i]) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
 	}
 
+	// May return -1 if protocol not enabled/supported
+	g_listen_fd4.fd = net_bind("TLS", "0.0.0.0", gconf->dht_port, NULL, IPPROTO_TCP);
+	g_listen_fd6.fd = net_bind("TLS", "::", gconf->dht_port, NULL, IPPROTO_TCP);
+
 	if (g_listen_fd4.fd > -1) {
 		mbedtls_net_set_nonblock(&g_listen_fd4);
-		net_add_handler(g_listen_fd4.fd, &tls_server_handler);
 	}
 
 	if (g_listen_fd6.fd > -1) {
 		mbedtls_net_set_nonblock(&g_listen_fd6);
-		net_add_handler(g_listen_fd6.fd, &tls_server_handler);
 	}
 
+	tls_server_accept(1);
+
+	// Cause the callback to be called in intervals
+	net_add_handler(-1, &tls_server_handle);
+
 	return EXIT_SUCCESS;
 }
 
 void tls_server_free(void)
 {
-	// Nothing to do
+	int i;
+
+	if (g_sni_entries == NULL) {
+		return;
+	}
+
+	// Sockets with a handler are closed by net_free()
+	if (!g_accepting) {
+		mbedtls_net_free(&g_listen_fd4);
+		mbedtls_net_free(&g_listen_fd6);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(g_connections); ++i) {
+		mbedtls_ssl_free(&g_connections[i].ssl);
+	}
+
+	for (i = 0; i < g_workers_num; ++i) {
+		mbedtls_ssl_config_free(&g_workers[i].conf);
+		mbedtls_ctr_drbg_free(&g_workers[i].drbg);
+		mbedtls_entropy_free(&g_workers[i].entropy);
+	}
+
+	free(g_workers);
+	g_workers = NULL;
+	g_workers_num = 0;
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_free(&g_ticket);
+	mbedtls_ctr_drbg_free(&g_ticket_drbg);
+	mbedtls_entropy_free(&g_ticket_entropy);
+#endif
 }
@@ -3,6 +3,9 @@
 
 #include <sys/time.h>
 #include <assert.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
 #include "log.h"
 #include "main.h"
@@ -12,9 +15,14 @@
 #include "net.h"
 #include "searches.h"
 #include "announces.h"
+#include "blacklist.h"
+#include "kad.h"
 #ifdef BOB
 #include "ext-bob.h"
 #endif
+#ifdef LPD
+#include "ext-lpd.h"
+#endif
 
 #include "dht.c"
 
@@ -28,6 +36,15 @@ static time_t g_dht_maintenance = 0;
 static int g_dht_socket4 = -1;
 static int g_dht_socket6 = -1;
 
+#ifdef __linux__
+// Blacklist state the socket filters were built from
+static unsigned int g_filter_changes = 0;
+static int g_filter_rules = -1;
+
+// forward declaration
+static void kad_filter_update(void);
+#endif
+
 
 /*
 * Put an address and port into a sockaddr_storages struct.
@@ -63,6 +80,14 @@ typedef struct {
 } dht_addr4_t;
 
 
+// Without good nodes, an empty search result means nothing
+static void kad_search_done(struct search_t *search)
+{
+	if (search->pending == 0 && kad_count_nodes(1) > 0) {
+		searches_done(search);
+	}
+}
+
 // This callback is called when a search result arrives or a search completes
 void dht_callback_func(void *closure, int event, const uint8_t *info_hash, const void *data, size_t data_len)
 {
@@ -94,18 +119,21 @@ void dht_callback_func(void *closure, int event, const uint8_t *info_hash, const
 			}
 			break;
 		case DHT_EVENT_SEARCH_DONE:
+			search->pending &= ~SEARCH_PENDING_IPV4;
+			kad_search_done(search);
+			break;
 		case DHT_EVENT_SEARCH_DONE6:
-			// Ignore..
+			search->pending &= ~SEARCH_PENDING_IPV6;
+			kad_search_done(search);
 			break;
 	}
 }
 
-#if 0
 /*
 * Lookup in values we announce ourselves.
 * Useful for networks of only one node, also faster.
 */
-void kad_lookup_own_announcements(struct search_t *search)
+static void kad_lookup_own_announcements(struct search_t *search)
 {
 	struct value_t* value;
 	int af;
@@ -130,7 +158,6 @@ void kad_lookup_own_announcements(struct search_t *search)
 		}
 	}
 }
-#endif
 
 // Handle incoming packets and pass them to the DHT code
 void dht_handler(int rc, int sock)
@@ -154,6 +181,9 @@ void dht_handler(int rc, int sock)
 		buf[buflen] = '\0';
 	} else {
 		buflen = 0;
+#ifdef __linux__
+		kad_filter_update();
+#endif
 	}
 
 #ifdef BOB
@@ -200,7 +230,7 @@ void dht_handler(int rc, int sock)
 }
 
 /*
-* Kademlia needs dht_blacklisted/dht_hash/dht_random_bytes functions to be present.
+* Kademlia needs dht_blacklisted/dht_blacklist/dht_hash/dht_random_bytes functions to be present.
 */
 
 int dht_sendto(int sockfd, const void *buf, int len, int flags, const struct sockaddr *to, int tolen)
@@ -210,7 +240,12 @@ int dht_sendto(int sockfd, const void *buf, int len, int flags, const struct soc
 
 int dht_blacklisted(const struct sockaddr *sa, int salen)
 {
-	return 0;
+	return blacklist_contains((const IP *) sa);
+}
+
+void dht_blacklist(const struct sockaddr *sa, int salen)
+{
+	blacklist_add((const IP *) sa);
 }
 
 // Hashing for the DHT - implementation does not matter for interoperability
@@ -255,6 +290,215 @@ int dht_random_bytes(void *buf, size_t size)
 	return bytes_random(buf, size);
 }
 
+#ifdef __linux__
+/*
+* Classic BPF socket filter for the DHT sockets. Datagrams that are
+* neither a bencoded dictionary nor a BOB message, DHT packets from
+* martian addresses and from blacklisted nodes are dropped by the
+* kernel before they are copied to us. The userspace checks in
+* dht_periodic() stay in place, the filter is only a shortcut.
+*
+* The filter runs on the UDP header, the payload starts at offset 8.
+*/
+
+// Offsets into the UDP header and IP headers
+#define FILTER_UDP_SPORT 0
+#define FILTER_PAYLOAD 8
+#define FILTER_IP4_SRC (SKF_NET_OFF + 12)
+#define FILTER_IP6_SRC (SKF_NET_OFF + 8)
+
+#define FILTER_ACCEPT 0xFFFFFFFF
+#define FILTER_DROP 0
+
+struct filter_prog {
+	struct sock_filter insns[BPF_MAXINSNS];
+	int len;
+};
+
+static int filter_emit(struct filter_prog *prog, uint16_t code, uint8_t jt, uint8_t jf, uint32_t k)
+{
+	if (prog->len >= BPF_MAXINSNS) {
+		return EXIT_FAILURE;
+	}
+
+	prog->insns[prog->len++] = (struct sock_filter) BPF_JUMP(code, k, jt, jf);
+	return EXIT_SUCCESS;
+}
+
+// Drop the packet if the accumulator equals k
+static void filter_drop_eq(struct filter_prog *prog, uint32_t k)
+{
+	filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, k);
+	filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_DROP);
+}
+
+// Drop DHT packets from addresses is_martian() would reject
+static void filter_add_martians(struct filter_prog *prog, int af)
+{
+	// Source port 0
+	filter_emit(prog, BPF_LD | BPF_H | BPF_ABS, 0, 0, FILTER_UDP_SPORT);
+	filter_drop_eq(prog, 0);
+
+	if (af == AF_INET) {
+		// 0.0.0.0/8, 127.0.0.0/8 and 224.0.0.0/3
+		filter_emit(prog, BPF_LD | BPF_B | BPF_ABS, 0, 0, FILTER_IP4_SRC);
+		filter_drop_eq(prog, 0);
+		filter_drop_eq(prog, 127);
+		filter_emit(prog, BPF_JMP | BPF_JGE | BPF_K, 0, 1, 224);
+		filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_DROP);
+	} else {
+		// ff00::/8 and fe80::/10
+		filter_emit(prog, BPF_LD | BPF_H | BPF_ABS, 0, 0, FILTER_IP6_SRC);
+		filter_emit(prog, BPF_JMP | BPF_JGE | BPF_K, 0, 1, 0xFF00);
+		filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_DROP);
+		filter_emit(prog, BPF_ALU | BPF_AND | BPF_K, 0, 0, 0xFFC0);
+		filter_drop_eq(prog, 0xFE80);
+
+		// ::, ::1 and ::ffff:0:0/96
+		filter_emit(prog, BPF_LD | BPF_W | BPF_ABS, 0, 0, FILTER_IP6_SRC);
+		filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 8, 0);
+		filter_emit(prog, BPF_LD | BPF_W | BPF_ABS, 0, 0, FILTER_IP6_SRC + 4);
+		filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 6, 0);
+		filter_emit(prog, BPF_LD | BPF_W | BPF_ABS, 0, 0, FILTER_IP6_SRC + 8);
+		filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 3, 0, 0x0000FFFF);
+		filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 3, 0);
+		filter_emit(prog, BPF_LD | BPF_W | BPF_ABS, 0, 0, FILTER_IP6_SRC + 12);
+		filter_emit(prog, BPF_JMP | BPF_JGT | BPF_K, 1, 0, 1);
+		filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_DROP);
+	}
+}
+
+// Drop DHT packets from a blacklisted address and port
+static int filter_add_blacklisted(struct filter_prog *prog, const struct blacklist_entry *entry)
+{
+	const uint32_t *w;
+	uint16_t port;
+	int words;
+	int tail;
+	int start;
+	int i;
+
+	// Each rule must fit completely, the final accept must still fit
+	start = prog->len;
+
+	// Instructions after the address comparison, port 0 matches all ports
+	port = addr_port(&entry->addr);
+	tail = port ? 3 : 1;
+
+	if (entry->addr.ss_family == AF_INET) {
+		const IP4 *a = (const IP4 *) &entry->addr;
+		filter_emit(prog, BPF_LD | BPF_W | BPF_ABS, 0, 0, FILTER_IP4_SRC);
+		filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, tail, ntohl(a->sin_addr.s_addr));
+	} else {
+		const IP6 *a = (const IP6 *) &entry->addr;
+		w = (const uint32_t *) &a->sin6_addr;
+		words = 4;
+		for (i = 0; i < words; i++) {
+			filter_emit(prog, BPF_LD | BPF_W | BPF_ABS, 0, 0, FILTER_IP6_SRC + 4 * i);
+			filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 2 * (words - i - 1) + tail, ntohl(w[i]));
+		}
+	}
+
+	if (port) {
+		filter_emit(prog, BPF_LD | BPF_H | BPF_ABS, 0, 0, FILTER_UDP_SPORT);
+		filter_drop_eq(prog, port);
+	} else {
+		filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_DROP);
+	}
+
+	if (prog->len > (BPF_MAXINSNS - 1)) {
+		prog->len = start;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int filter_attach(int sock, int af)
+{
+	const struct blacklist_entry *entries;
+	struct filter_prog *prog;
+	struct sock_fprog fprog;
+	int rules;
+	int num;
+	int rc;
+	int i;
+
+	prog = calloc(1, sizeof(struct filter_prog));
+	if (prog == NULL) {
+		return -1;
+	}
+
+	// Accept "d..." (bencoded dictionary) and "BOB..." (BOB extension)
+	filter_emit(prog, BPF_LD | BPF_B | BPF_ABS, 0, 0, FILTER_PAYLOAD);
+	filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 'd');
+	filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 3, 'B');
+	filter_emit(prog, BPF_LD | BPF_H | BPF_ABS, 0, 0, FILTER_PAYLOAD + 1);
+	filter_emit(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, ('O' << 8) | 'B');
+	filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_ACCEPT);
+	filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_DROP);
+
+	filter_add_martians(prog, af);
+
+	rules = 0;
+	entries = blacklist_entries(&num);
+	for (i = 0; i < num; i++) {
+		if (entries[i].addr.ss_family != af || !blacklist_entry_active(&entries[i])) {
+			continue;
+		}
+
+		if (filter_add_blacklisted(prog, &entries[i]) != EXIT_SUCCESS) {
+			// The remaining entries are still caught by dht_periodic()
+			break;
+		}
+		rules += 1;
+	}
+
+	filter_emit(prog, BPF_RET | BPF_K, 0, 0, FILTER_ACCEPT);
+
+	fprog.len = prog->len;
+	fprog.filter = prog->insns;
+
+	rc = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+	free(prog);
+
+	if (rc < 0) {
+		log_warning("KAD: Failed to attach socket filter: %s", strerror(errno));
+		return -1;
+	}
+
+	return rules;
+}
+
+// Rebuild the socket filters when the blacklist has changed
+static void kad_filter_update(void)
+{
+	int rules4 = 0;
+	int rules6 = 0;
+
+	if (!gconf->dht_filter_enable) {
+		return;
+	}
+
+	if (g_filter_rules >= 0 && g_filter_changes == blacklist_changes()) {
+		return;
+	}
+
+	if (g_dht_socket4 >= 0) {
+		rules4 = filter_attach(g_dht_socket4, AF_INET);
+	}
+
+	if (g_dht_socket6 >= 0) {
+		rules6 = filter_attach(g_dht_socket6, AF_INET6);
+	}
+
+	g_filter_changes = blacklist_changes();
+	g_filter_rules = MAX(rules4, 0) + MAX(rules6, 0);
+
+	log_debug("KAD: Socket filter updated with %d blacklist rules.", g_filter_rules);
+}
+#endif
+
 int kad_setup(void)
 {
 	uint8_t node_id[SHA1_BIN_LENGTH];
@@ -287,6 +531,10 @@ int kad_setup(void)
 		return EXIT_FAILURE;
 	}
 
+#ifdef __linux__
+	kad_filter_update();
+#endif
+
 	return EXIT_SUCCESS;
 }
 
@@ -322,6 +570,11 @@ int kad_count_nodes(int good)
 	return kad_count_bucket(buckets, good) + kad_count_bucket(buckets6, good);
 }
 
+int kad_count_announce_searches(void)
+{
+	return numannouncesearches;
+}
+
 void kad_status(FILE *fp)
 {
 	struct storage *strg = storage;
@@ -370,7 +623,8 @@ void kad_status(FILE *fp)
 		"DHT Storage: %d (max %d) entries with %d addresses (max %d)\n"
 		"DHT Searches: %d active, %d completed (max %d)\n"
 		"DHT Announcements: %d\n"
-		"DHT Blacklist: %d (max %d)\n",
+		"DHT Blacklist: %d (max %d)\n"
+		"DHT Rate Limit: %lu dropped by prefix, %lu dropped overall\n",
 		kadnode_version_str,
 		str_id(myid),
 		str_af(gconf->af), gconf->dht_ifname ? gconf->dht_ifname : "<any>",
@@ -378,8 +632,15 @@ void kad_status(FILE *fp)
 		numstorage, DHT_MAX_HASHES, numstorage_peers, DHT_MAX_PEERS,
 		numsearches_active, numsearches_done, DHT_MAX_SEARCHES,
 		numannounces,
-		(next_blacklisted % DHT_MAX_BLACKLISTED), DHT_MAX_BLACKLISTED
+		blacklist_count(), gconf->blacklist_size,
+		rate_prefix_drops, token_bucket_drops
 	);
+
+#ifdef __linux__
+	if (gconf->dht_filter_enable) {
+		fprintf(fp, "DHT Filter: %d blacklist rules\n", MAX(g_filter_rules, 0));
+	}
+#endif
 }
 
 int kad_ping(const IP* addr)
@@ -422,7 +683,62 @@ int kad_announce(const char query[], int port, time_t lifetime)
 	}
 
 	// Store query to call kad_announce_once() later/multiple times
-	return announces_add(hostname, port, lifetime) ? EXIT_SUCCESS : EXIT_FAILURE;
+	return announces_add(hostname, port, lifetime, ANNOUNCES_SOURCE_OTHER) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifdef LPD
+/*
+* Send get_peers requests to peers in the local network in parallel
+* to the DHT search. The transaction id of the DHT search is used,
+* so that the replies are handled as part of that search.
+*/
+static void kad_search_lan(const uint8_t id[])
+{
+	IP addrs[LPD_PEERS_MAX];
+	unsigned char tid[4];
+	struct search *sr;
+	int num;
+	int i;
+
+	num = lpd_get_peers(addrs, ARRAY_SIZE(addrs));
+	for (i = 0; i < num; i++) {
+		sr = searches;
+		while (sr) {
+			if (sr->af == addrs[i].ss_family && id_cmp(sr->id, id) == 0) {
+				break;
+			}
+			sr = sr->next;
+		}
+
+		if (sr == NULL) {
+			continue;
+		}
+
+		log_debug("KAD: Ask local peer %s", str_addr(&addrs[i]));
+		make_tid(tid, "gp", sr->tid);
+		send_get_peers((struct sockaddr*) &addrs[i], addr_len(&addrs[i]), tid, 4, sr->id, -1, 0);
+	}
+}
+#endif
+
+void kad_start_search(struct search_t *search)
+{
+	// The done event might be issued right away, keep search until we are done here
+	search->pending = SEARCH_PENDING_START | SEARCH_PENDING_IPV4 | SEARCH_PENDING_IPV6;
+
+	// Answer from own announcements right away, the DHT search answers from storage
+	kad_lookup_own_announcements(search);
+
+	if (dht_search(search->id, 0, AF_INET, dht_callback_func, NULL) < 0) {
+		search->pending &= ~SEARCH_PENDING_IPV4;
+	}
+	if (dht_search(search->id, 0, AF_INET6, dht_callback_func, NULL) < 0) {
+		search->pending &= ~SEARCH_PENDING_IPV6;
+	}
+#ifdef LPD
+	kad_search_lan(search->id);
+#endif
+	search->pending &= ~SEARCH_PENDING_START;
 }
 
 // Lookup known nodes that are nearest to the given id
@@ -430,6 +746,7 @@ int kad_lookup(const char query[], IP addr_array[], size_t *addr_num)
 {
 	char hostname[QUERY_MAX_SIZE];
 	struct search_t *search;
+	int reason;
 
 	// Remove .p2p suffix and convert to lowercase
 	if (EXIT_FAILURE == query_sanitize(hostname, sizeof(hostname), query)) {
@@ -439,6 +756,15 @@ int kad_lookup(const char query[], IP addr_array[], size_t *addr_num)
 
 	log_debug("KAD: Lookup identifier: %s", hostname);
 
+	// Query failed recently, do not search again
+	reason = searches_negative(hostname);
+	if (reason == NEGATIVE_UNSUPPORTED) {
+		return EXIT_FAILURE;
+	} else if (reason >= 0) {
+		*addr_num = 0;
+		return EXIT_SUCCESS;
+	}
+
 	// Find existing or create new search
 	search = searches_start(hostname);
 
@@ -450,13 +776,8 @@ int kad_lookup(const char query[], IP addr_array[], size_t *addr_num)
 
 	// Search was just started
 	if (search->start_time == time_now_sec()) {
-#if 0
-		// Search own announces
-		kad_lookup_own_announcements(search);
-#endif
 		// Start a new DHT search
-		dht_search(search->id, 0, AF_INET, dht_callback_func, NULL);
-		dht_search(search->id, 0, AF_INET6, dht_callback_func, NULL);
+		kad_start_search(search);
 	}
 
 	// Collect addresses to be returned
@@ -507,6 +828,10 @@ int kad_blacklist(const IP* addr)
 
 	blacklist_node(NULL, (struct sockaddr *) addr, sizeof(IP));
 
+#ifdef __linux__
+	kad_filter_update();
+#endif
+
 	return EXIT_SUCCESS;
 }
 
@@ -617,15 +942,30 @@ void kad_debug_storage(FILE *fp)
 	fprintf(fp, " Found %d stored hashes from received announcements.\n", j);
 }
 
-void kad_debug_blacklist(FILE *fp)
+// Print request drop counters of rate limited network prefixes
+void kad_debug_ratelimit(FILE *fp)
 {
+	char buf[INET6_ADDRSTRLEN];
+	uint8_t addr[16];
+	struct rate_prefix *rp;
+	int count;
 	int i;
 
-	for (i = 0; i < (next_blacklisted % DHT_MAX_BLACKLISTED); i++) {
-		fprintf(fp, " %s\n", str_addr(&blacklist[i]));
+	count = 0;
+	for (i = 0; i < DHT_RATE_PREFIXES; i++) {
+		rp = &rate_prefixes[i];
+		if (rp->len == 0 || rp->drops == 0) {
+			continue;
+		}
+
+		memset(addr, 0, sizeof(addr));
+		memcpy(addr, rp->prefix, rp->len);
+		inet_ntop((rp->len == 3) ? AF_INET : AF_INET6, addr, buf, sizeof(buf));
+		fprintf(fp, " %s/%d: %lu dropped, %d tokens\n", buf, 8 * rp->len, rp->drops, rp->tokens);
+		count += 1;
 	}
 
-	fprintf(fp, " Found %d blacklisted addresses.\n", i);
+	fprintf(fp, " Found %d rate limited prefixes.\n", count);
 }
 
 void kad_debug_constants(FILE *fp)
@@ -633,12 +973,18 @@ void kad_debug_constants(FILE *fp)
 	fprintf(fp, "DHT_SEARCH_EXPIRE_TIME: %d\n", DHT_SEARCH_EXPIRE_TIME);
 	fprintf(fp, "DHT_MAX_SEARCHES: %d\n", DHT_MAX_SEARCHES);
 
+	// Keep write tokens to refresh announcements
+	fprintf(fp, "DHT_TOKEN_REUSE_TIME: %d\n", DHT_TOKEN_REUSE_TIME);
+
 	// Maximum number of announced hashes we track
 	fprintf(fp, "DHT_MAX_HASHES: %d\n", DHT_MAX_HASHES);
 
 	// Maximum number of peers for each announced hash we track
 	fprintf(fp, "DHT_MAX_PEERS: %d\n", DHT_MAX_PEERS);
 
-	// Maximum number of blacklisted nodes
-	fprintf(fp, "DHT_MAX_BLACKLISTED: %d\n", DHT_MAX_BLACKLISTED);
+	// Lifetime of blacklisted addresses
+	fprintf(fp, "BLACKLIST_LIFETIME: %d\n", BLACKLIST_LIFETIME);
+
+	// Number of network prefixes tracked for rate limiting
+	fprintf(fp, "DHT_RATE_PREFIXES: %d\n", DHT_RATE_PREFIXES);
 }
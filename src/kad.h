@@ -17,6 +17,10 @@ int kad_ping(const IP *addr);
 // Blacklist a specific address
 int kad_blacklist(const IP* addr);
 
+// Collect local results and start the DHT searches for a search
+struct search_t;
+void kad_start_search(struct search_t *search);
+
 /*
 * Lookup the addresses of the nodes who have announced value id.
 * The first call will start the search.
@@ -32,6 +36,9 @@ void kad_status(FILE *fp);
 // Count good or all known peers
 int kad_count_nodes(int good);
 
+// Count DHT searches that are about to announce a value
+int kad_count_announce_searches(void);
+
 /*
 * Announce that the resource identified by id can
 * be served by this computer using the given port.
@@ -45,7 +52,7 @@ int kad_announce(const char query[], int port, time_t lifetime);
 void kad_debug_buckets(FILE *fp);
 void kad_debug_searches(FILE *fp);
 void kad_debug_storage(FILE *fp);
-void kad_debug_blacklist(FILE *fp);
+void kad_debug_ratelimit(FILE *fp);
 void kad_debug_constants(FILE *fp);
 
 #endif // _KAD_H_
@@ -15,9 +15,9 @@
 // Program start time
 static struct timespec log_start = { 0, 0 };
 
-const char *log_time()
+// Write the time since program start, log calls may come from worker threads
+static const char *log_time(char buf[], size_t len)
 {
-	static char buf[16];
 	struct timespec now = { 0, 0 };
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
@@ -27,7 +27,7 @@ const char *log_time()
 		clock_gettime(CLOCK_MONOTONIC, &log_start);
 	}
 
-	sprintf(buf, "[%8.2f] ",
+	snprintf(buf, len, "[%8.2f] ",
 		((double) now.tv_sec + 1.0e-9 * now.tv_nsec) -
 		((double) log_start.tv_sec + 1.0e-9 * log_start.tv_nsec)
 	);
@@ -48,7 +48,8 @@ void log_print(int priority, const char format[], ...)
 	va_end(vlist);
 
 #ifdef DEBUG
-	time = log_time();
+	char timebuf[16];
+	time = log_time(timebuf, sizeof(timebuf));
 #else
 	time = "";
 #endif
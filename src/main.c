@@ -17,7 +17,9 @@
 #include "net.h"
 #include "announces.h"
 #include "searches.h"
+#include "blacklist.h"
 #include "peerfile.h"
+#include "manifest.h"
 #ifdef __CYGWIN__
 #include "windows.h"
 #endif
@@ -28,6 +30,9 @@
 #ifdef BOB
 #include "ext-bob.h"
 #endif
+#if defined(BOB) || defined(TLS)
+#include "workers.h"
+#endif
 #ifdef DNS
 #include "ext-dns.h"
 #endif
@@ -66,14 +71,20 @@ int main_run(void)
 	rc |= fwd_setup();
 #endif
 
+	// Setup blacklist used by the DHT
+	rc |= blacklist_setup();
+
 	// Setup the Kademlia DHT
 	rc |= kad_setup();
 
 	// Setup handler to announces
 	announces_setup();
 
+	// Setup announcements from manifest file
+	rc |= manifest_setup();
+
 	// Setup handler to expire results
-	searches_setup();
+	rc |= searches_setup();
 
 	// Setup import of peerfile
 	peerfile_setup();
@@ -83,6 +94,9 @@ int main_run(void)
 	rc |= lpd_setup();
 #endif
 
+#if defined(BOB) || defined(TLS)
+	rc |= workers_setup();
+#endif
 #ifdef BOB
 	rc |= bob_setup();
 #endif
@@ -121,6 +135,10 @@ int main_run(void)
 #ifdef DNS
 	dns_free();
 #endif
+#if defined(BOB) || defined(TLS)
+	// Stop threads before their contexts are freed
+	workers_free();
+#endif
 #ifdef BOB
 	bob_free();
 #endif
@@ -134,12 +152,16 @@ int main_run(void)
 
 	peerfile_free();
 
+	manifest_free();
+
 	searches_free();
 
 	announces_free();
 
 	kad_free();
 
+	blacklist_free();
+
 #ifdef FWD
 	fwd_free();
 #endif
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "net.h"
+#include "announces.h"
+#include "manifest.h"
+
+
+// Check the file for changes every 5 seconds when inotify is not available
+#define MANIFEST_POLL_INTERVAL 5
+
+// An announcement added by the manifest file
+struct entry {
+	struct entry *next;
+	uint8_t id[SHA1_BIN_LENGTH];
+	char query[QUERY_MAX_SIZE];
+	int port;
+	int minutes;
+	unsigned int generation;
+};
+
+// Hash table of entries by query
+static struct entry **g_entries = NULL;
+static int g_entries_size = 0;
+static int g_entries_num = 0;
+
+// Incremented on every reload, entries not seen are removed
+static unsigned int g_generation = 0;
+
+static int g_reload = 0;
+static time_t g_poll_time = 0;
+static time_t g_mtime = 0;
+static off_t g_fsize = 0;
+
+#ifdef __linux__
+static int g_inotify_fd = -1;
+static const char *g_basename = NULL;
+#endif
+
+
+// FNV-1a
+static int entry_slot(const char query[], int size)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*query) {
+		hash = (hash ^ (uint8_t) *query++) * 16777619U;
+	}
+
+	return hash & (size - 1);
+}
+
+static struct entry *entry_find(const char query[])
+{
+	struct entry *entry;
+
+	if (g_entries_size == 0) {
+		return NULL;
+	}
+
+	entry = g_entries[entry_slot(query, g_entries_size)];
+	while (entry) {
+		if (strcmp(entry->query, query) == 0) {
+			return entry;
+		}
+		entry = entry->next;
+	}
+
+	return NULL;
+}
+
+static struct entry *entry_add(const char query[])
+{
+	struct entry **entries;
+	struct entry *entry;
+	struct entry *next;
+	int size;
+	int i;
+
+	// Grow and rehash when the load factor exceeds 1
+	if (g_entries_num >= g_entries_size) {
+		size = g_entries_size ? (2 * g_entries_size) : 64;
+		entries = (struct entry**) calloc(size, sizeof(struct entry*));
+		if (entries == NULL) {
+			return NULL;
+		}
+
+		for (i = 0; i < g_entries_size; i++) {
+			entry = g_entries[i];
+			while (entry) {
+				next = entry->next;
+				entry->next = entries[entry_slot(entry->query, size)];
+				entries[entry_slot(entry->query, size)] = entry;
+				entry = next;
+			}
+		}
+
+		free(g_entries);
+		g_entries = entries;
+		g_entries_size = size;
+	}
+
+	entry = (struct entry*) calloc(1, sizeof(struct entry));
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	memcpy(entry->query, query, strlen(query));
+
+	i = entry_slot(query, g_entries_size);
+	entry->next = g_entries[i];
+	g_entries[i] = entry;
+	g_entries_num += 1;
+
+	return entry;
+}
+
+// Apply a single line, return 1 for an added or changed entry
+static int manifest_apply_line(const char line[], int nline)
+{
+	char query[QUERY_MAX_SIZE];
+	char name[QUERY_MAX_SIZE];
+	struct value_t *value;
+	struct entry *entry;
+	time_t lifetime;
+	int minutes;
+	int port;
+	int n;
+
+	port = gconf->dht_port;
+	minutes = -1;
+
+	n = sscanf(line, " %254[^: \t]:%d:%d", name, &port, &minutes);
+	if (n < 1 || (n == 1 && strchr(line, ':')) || port < 1 || port > 65535 || (n == 3 && minutes < 1)) {
+		log_warning("MANIFEST: Invalid line %d: %s", nline, line);
+		return 0;
+	}
+
+	if (query_sanitize(query, sizeof(query), name) != EXIT_SUCCESS) {
+		log_warning("MANIFEST: Invalid name on line %d: %s", nline, name);
+		return 0;
+	}
+
+	entry = entry_find(query);
+
+	// Unchanged
+	if (entry && entry->port == port && entry->minutes == minutes) {
+		entry->generation = g_generation;
+		return 0;
+	}
+
+	if (minutes < 0) {
+		lifetime = LONG_MAX;
+	} else {
+		lifetime = time_now_sec() + (minutes * 60);
+	}
+
+	value = announces_add(query, port, lifetime, ANNOUNCES_SOURCE_MANIFEST);
+	if (value == NULL) {
+		return 0;
+	}
+
+	if (entry == NULL) {
+		entry = entry_add(query);
+		if (entry == NULL) {
+			return 0;
+		}
+	}
+
+	memcpy(entry->id, value->id, SHA1_BIN_LENGTH);
+	entry->port = port;
+	entry->minutes = minutes;
+	entry->generation = g_generation;
+
+	return 1;
+}
+
+// Remove entries that were not seen on the last reload
+static int manifest_remove_stale(void)
+{
+	struct entry **cur;
+	struct entry *entry;
+	int removed;
+	int i;
+
+	removed = 0;
+	for (i = 0; i < g_entries_size; i++) {
+		cur = &g_entries[i];
+		while (*cur) {
+			entry = *cur;
+			if (entry->generation != g_generation) {
+				announces_remove(entry->id, ANNOUNCES_SOURCE_MANIFEST);
+				*cur = entry->next;
+				free(entry);
+				g_entries_num -= 1;
+				removed += 1;
+			} else {
+				cur = &entry->next;
+			}
+		}
+	}
+
+	return removed;
+}
+
+static void manifest_load(void)
+{
+	const char *filename;
+	char linebuf[512];
+	struct stat st;
+	int changed;
+	int removed;
+	int nline;
+	FILE *fp;
+
+	filename = gconf->announce_manifest;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		log_warning("MANIFEST: Cannot open file '%s': %s", filename, strerror(errno));
+		return;
+	}
+
+	if (fstat(fileno(fp), &st) == 0) {
+		g_mtime = st.st_mtime;
+		g_fsize = st.st_size;
+	}
+
+	g_generation += 1;
+	changed = 0;
+	nline = 0;
+
+	while (fgets(linebuf, sizeof(linebuf), fp) != NULL) {
+		nline += 1;
+		linebuf[strcspn(linebuf, "#\n\r")] = '\0';
+
+		if (linebuf[strspn(linebuf, " \t")] == '\0') {
+			continue;
+		}
+
+		changed += manifest_apply_line(linebuf, nline);
+	}
+
+	fclose(fp);
+
+	removed = manifest_remove_stale();
+
+	log_info("MANIFEST: Loaded '%s': %d entries, %d added or changed, %d removed",
+		filename, g_entries_num, changed, removed);
+}
+
+#ifdef __linux__
+// Check if the file we watch was written or replaced
+static void manifest_read_events(int fd)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *) ptr;
+			if (event->len && strcmp(event->name, g_basename) == 0) {
+				g_reload = 1;
+			}
+		}
+	}
+}
+#endif
+
+static void manifest_handle(int rc, int fd)
+{
+	struct stat st;
+
+#ifdef __linux__
+	if (rc > 0 && fd >= 0) {
+		manifest_read_events(fd);
+	}
+#endif
+
+	// Fall back to polling the modification time
+	if (fd < 0 && g_poll_time <= time_now_sec()) {
+		if (stat(gconf->announce_manifest, &st) == 0
+				&& (st.st_mtime != g_mtime || st.st_size != g_fsize)) {
+			g_reload = 1;
+		}
+		g_poll_time = time_add_secs(MANIFEST_POLL_INTERVAL);
+	}
+
+	if (g_reload) {
+		g_reload = 0;
+		manifest_load();
+	}
+}
+
+#ifdef __linux__
+static int manifest_watch(void)
+{
+	char dirname[PATH_MAX];
+	const char *slash;
+
+	// Watch the directory to also catch files that are replaced by a rename
+	slash = strrchr(gconf->announce_manifest, '/');
+	if (slash) {
+		snprintf(dirname, sizeof(dirname), "%.*s",
+			(int) (slash - gconf->announce_manifest + 1), gconf->announce_manifest);
+		g_basename = slash + 1;
+	} else {
+		snprintf(dirname, sizeof(dirname), ".");
+		g_basename = gconf->announce_manifest;
+	}
+
+	g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_inotify_fd >= 0 && inotify_add_watch(g_inotify_fd, dirname, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) {
+		net_add_handler(g_inotify_fd, &manifest_handle);
+		return EXIT_SUCCESS;
+	}
+
+	log_warning("MANIFEST: Cannot watch '%s', fall back to polling: %s", dirname, strerror(errno));
+	if (g_inotify_fd >= 0) {
+		close(g_inotify_fd);
+		g_inotify_fd = -1;
+	}
+
+	return EXIT_FAILURE;
+}
+#endif
+
+int manifest_setup(void)
+{
+	if (gconf->announce_manifest == NULL) {
+		return EXIT_SUCCESS;
+	}
+
+	manifest_load();
+
+#ifdef __linux__
+	if (manifest_watch() == EXIT_SUCCESS) {
+		return EXIT_SUCCESS;
+	}
+#endif
+
+	net_add_handler(-1, &manifest_handle);
+
+	return EXIT_SUCCESS;
+}
+
+void manifest_free(void)
+{
+	struct entry *entry;
+	struct entry *next;
+	int i;
+
+	for (i = 0; i < g_entries_size; i++) {
+		entry = g_entries[i];
+		while (entry) {
+			next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+
+	free(g_entries);
+	g_entries = NULL;
+	g_entries_size = 0;
+	g_entries_num = 0;
+
+#ifdef __linux__
+	// The descriptor is closed by net_free()
+	g_inotify_fd = -1;
+#endif
+}
@@ -0,0 +1,18 @@
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+
+/*
+* Announce all names listed in a manifest file.
+* Each line has the format <name>[:<port>[:<minutes>]].
+* The file is reloaded when it changes and only added,
+* changed or removed entries are applied to the announcements.
+*/
+
+// Setup callbacks
+int manifest_setup(void);
+void manifest_free(void);
+
+
+#endif // _MANIFEST_H
@@ -21,8 +21,17 @@
 #include "net.h"
 
 
-static struct pollfd g_fds[16] = { { .fd = -1, .events = POLLIN, .revents = 0 } };
-static net_callback* g_cbs[16] = { NULL };
+// Handlers, slots with a NULL callback are free
+static struct pollfd *g_fds = NULL;
+static net_callback **g_cbs = NULL;
+static int g_count = 0;
+static int g_size = 0;
+
+// Time handlers want to be called before the next second (ms)
+static uint64_t g_wakeup = 0;
+
+// Paused sockets are stored as negative value below -1, poll() ignores them
+#define NET_PAUSED(fd) (-2 - (fd))
 
 
 // Set a socket non-blocking
@@ -40,17 +49,29 @@ void net_add_handler(int fd, net_callback *cb)
 		exit(1);
 	}
 
-	for (i = 0; i < ARRAY_SIZE(g_cbs); i++) {
+	for (i = 0; i < g_count; i++) {
 		if (g_cbs[i] == NULL) {
-			g_cbs[i] = cb;
-			g_fds[i].fd = fd;
-			g_fds[i].events = POLLIN;
-			return;
+			break;
 		}
 	}
 
-	log_error("No more space for handlers.");
-	exit(1);
+	if (i == g_size) {
+		g_size = g_size ? (2 * g_size) : 16;
+		g_fds = (struct pollfd*) realloc(g_fds, g_size * sizeof(struct pollfd));
+		g_cbs = (net_callback**) realloc(g_cbs, g_size * sizeof(net_callback*));
+
+		if (g_fds == NULL || g_cbs == NULL) {
+			log_error("No more space for handlers.");
+			exit(1);
+		}
+	}
+
+	if (i == g_count) {
+		g_count += 1;
+	}
+
+	g_cbs[i] = cb;
+	g_fds[i] = (struct pollfd){ .fd = fd, .events = POLLIN, .revents = 0 };
 }
 
 void net_remove_handler(int fd, net_callback *cb)
@@ -62,8 +83,8 @@ void net_remove_handler(int fd, net_callback *cb)
 		exit(1);
 	}
 
-	for (i = 0; i < ARRAY_SIZE(g_cbs); i++) {
-		if (g_cbs[i] == cb && g_fds[i].fd == fd) {
+	for (i = 0; i < g_count; i++) {
+		if (g_cbs[i] == cb && (g_fds[i].fd == fd || g_fds[i].fd == NET_PAUSED(fd))) {
 			g_cbs[i] = NULL;
 			g_fds[i].fd = -1;
 			return;
@@ -74,15 +95,47 @@ void net_remove_handler(int fd, net_callback *cb)
 	exit(1);
 }
 
+void net_set_events(int fd, net_callback *cb, short events)
+{
+	int i;
+
+	for (i = 0; i < g_count; i++) {
+		if (g_cbs[i] == cb && (g_fds[i].fd == fd || g_fds[i].fd == NET_PAUSED(fd))) {
+			// Also suppress POLLHUP and POLLERR while paused
+			g_fds[i].fd = events ? fd : NET_PAUSED(fd);
+			g_fds[i].events = events;
+			return;
+		}
+	}
+
+	log_error("Handler not found to set events.");
+	exit(1);
+}
+
+void net_wakeup(uint64_t time_ms)
+{
+	if (g_wakeup == 0 || time_ms < g_wakeup) {
+		g_wakeup = time_ms;
+	}
+}
+
 void net_loop(void)
 {
+	uint64_t now_ms;
+	int timeout;
 	time_t n;
 	int all;
 	int rc;
 	int i;
 
 	while (gconf->is_running) {
-		rc = poll(g_fds, ARRAY_SIZE(g_fds), 1000);
+		timeout = 1000;
+		if (g_wakeup) {
+			now_ms = time_now_ms();
+			timeout = (g_wakeup > now_ms) ? MIN(g_wakeup - now_ms, 1000) : 0;
+		}
+
+		rc = poll(g_fds, g_count, timeout);
 
 		if (rc < 0) {
 			//log_error("poll(): %s", strerror(errno));
@@ -93,8 +146,15 @@ void net_loop(void)
 		all = (n > gconf->time_now);
 		gconf->time_now = n;
 
-		for (i = 0; i < ARRAY_SIZE(g_cbs); i++) {
-			if (g_cbs[i]) {
+		// Handlers may ask for another wakeup
+		if (g_wakeup && g_wakeup <= time_now_ms()) {
+			g_wakeup = 0;
+			all = 1;
+		}
+
+		// Handlers may be added or removed by callbacks
+		for (i = 0; i < g_count; i++) {
+			if (g_cbs[i] && g_fds[i].fd >= -1) {
 				int revents = g_fds[i].revents;
 				if (revents || all) {
 					g_cbs[i](revents, g_fds[i].fd);
@@ -191,7 +251,7 @@ int net_bind(
 		goto fail;
 	}
 
-	if (protocol == IPPROTO_TCP && listen(sock, 5) < 0) {
+	if (protocol == IPPROTO_TCP && listen(sock, SOMAXCONN) < 0) {
 		log_error("%s: Failed to listen on %s: %s (%s)",
 			name, str_addr(&sockaddr), strerror(errno)
 		);
@@ -213,9 +273,18 @@ void net_free(void)
 {
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(g_cbs); i++) {
-		g_cbs[i] = NULL;
-		close(g_fds[i].fd);
-		g_fds[i] = (struct pollfd){ .fd = -1, .events = POLLIN, .revents = 0 };
+	for (i = 0; i < g_count; i++) {
+		if (g_cbs[i] && g_fds[i].fd >= 0) {
+			close(g_fds[i].fd);
+		} else if (g_cbs[i] && g_fds[i].fd < -1) {
+			close(NET_PAUSED(g_fds[i].fd));
+		}
 	}
+
+	free(g_fds);
+	free(g_cbs);
+	g_fds = NULL;
+	g_cbs = NULL;
+	g_count = 0;
+	g_size = 0;
 }
@@ -23,12 +23,21 @@ int net_bind(
 	const int protocol
 );
 
+// Set a file descriptor non-blocking
+int net_set_nonblocking(int fd);
+
 // Add callback with file descriptor to listen for packets
 void net_add_handler(int fd, net_callback *callback);
 
 // Remove callback
 void net_remove_handler(int fd, net_callback *callback);
 
+// Set poll events of a handler (POLLIN by default), 0 pauses it including the interval calls
+void net_set_events(int fd, net_callback *callback, short events);
+
+// Call all handlers without events at this time (ms), besides once per second
+void net_wakeup(uint64_t time_ms);
+
 // Start loop for all network events
 void net_loop(void);
 
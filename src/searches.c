@@ -2,13 +2,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdint.h>
+#include <ifaddrs.h>
 
 #include "log.h"
 #include "main.h"
 #include "conf.h"
 #include "utils.h"
 #include "net.h"
+#include "kad.h"
 #ifdef BOB
 #include "ext-bob.h"
 #endif
@@ -24,15 +28,141 @@
 * Therefore, results are collected and stored here.
 */
 
+/*
+* Searches are kept in a list ordered by last access (most recent first)
+* and indexed by id and by query in two hash tables. When the cache is
+* full, the least recently used search is replaced. Completed searches
+* near the end of the list are replaced first, so that searches which
+* are still authenticating results are not aborted.
+*
+* Searches for names that are looked up often are restarted in the
+* background shortly before a lookup would restart them, while the
+* already verified addresses are still returned.
+*
+* Names given by --warmup are looked up as soon as the DHT has enough
+* good nodes. Their searches are always refreshed and never replaced.
+*
+* Results are returned ordered by proximity (loopback, same subnet,
+* private network, global), then by round-trip time, then IPv6 before
+* IPv4. The round-trip time is measured for every result that is
+* authenticated: the TCP connect time for TLS and the challenge reply
+* time for BOB.
+*
+* Searches with results to authenticate are queued per authentication
+* method. Each turn takes one result from the first search in the queue
+* and puts the search back at the end if it has more results waiting.
+* Up to SEARCHES_AUTH_RACE results of a search are authenticated at the
+* same time, started one after another like Happy Eyeballs (RFC 8305).
+*
+* Queries that failed are remembered for a while, so that repeated
+* lookups of dead or misspelled names do not cause new DHT searches.
+*/
+
 // Expected lifetime of announcements
 #define MAX_SEARCH_LIFETIME (20*60)
-#define MAX_RESULTS_PER_SEARCH 16
-#define MAX_SEARCHES 64
 
+// Number of least recently used searches to check for a completed one
+#define SEARCHES_EVICT_SCAN 8
+
+// Check for expired results every minute
+#define SEARCHES_EXPIRE_INTERVAL 60
+
+// Lookups needed since the last start for a search to be refreshed in the background
+#define SEARCHES_PREFETCH_HITS 2
+
+// Refresh this many seconds before a lookup would restart the search
+#define SEARCHES_PREFETCH_MARGIN 60
+
+// Check for searches to refresh every 10 seconds, but not too many at once
+#define SEARCHES_PREFETCH_INTERVAL 10
+#define SEARCHES_PREFETCH_MAX 8
+
+// Warm up when the DHT has this many good nodes, or any good node after the timeout
+#define SEARCHES_WARMUP_NODES 8
+#define SEARCHES_WARMUP_TIMEOUT 60
 
-// A ring buffer for of all searches
-static struct search_t *g_searches[MAX_SEARCHES] = { NULL };
-static size_t g_searches_idx = 0;
+// Restart warm up searches that failed every 5 minutes
+#define SEARCHES_WARMUP_INTERVAL (5*60)
+
+
+// Hash tables of searches by id and by query
+static struct search_t **g_by_id = NULL;
+static struct search_t **g_by_query = NULL;
+static int g_buckets_num = 0;
+
+// All searches, most recently used first
+static struct search_t *g_searches = NULL;
+static struct search_t *g_searches_last = NULL;
+static int g_searches_num = 0;
+
+// Searches marked as failed
+static int g_failed_num = 0;
+
+static time_t g_expire_time = 0;
+static time_t g_prefetch_time = 0;
+static unsigned int g_prefetch_count = 0;
+
+// A name to look up on startup, given by --warmup
+struct warmup {
+	struct warmup *next;
+	char *name;
+};
+
+static struct warmup *g_warmups = NULL;
+static time_t g_warmup_time = 0;
+
+// Searches with results waiting for authentication
+struct auth_queue {
+	auth_callback *callback;
+	struct search_t *first;
+	struct search_t *last;
+	int num;
+	int race; // Results of a search to authenticate at once, 0 for all
+};
+
+// Results of a search to authenticate at the same time
+#define SEARCHES_AUTH_RACE 3
+
+// Delay before the next result of a search is authenticated (ms)
+#define SEARCHES_AUTH_STAGGER_MS 250
+
+// One queue per authentication method (TLS, BOB)
+#define AUTH_QUEUES_MAX 4
+
+static struct auth_queue g_auth_queues[AUTH_QUEUES_MAX];
+
+// Local interface addresses, to detect results in the same subnet
+static struct ifaddrs *g_ifaddrs = NULL;
+
+// A query that recently failed
+struct negative_t {
+	struct negative_t *next;
+	struct negative_t *fifo_next;
+	char query[QUERY_MAX_SIZE];
+	enum NEGATIVE_REASON reason;
+	time_t expire;
+};
+
+// Hash table of failed queries, oldest entries first in the fifo
+static struct negative_t **g_negatives = NULL;
+static struct negative_t *g_negatives_oldest = NULL;
+static struct negative_t *g_negatives_newest = NULL;
+static int g_negatives_num = 0;
+
+// A successful authentication that outlives the search
+struct verified_t {
+	struct verified_t *next;
+	struct verified_t *fifo_next;
+	char query[QUERY_MAX_SIZE];
+	IP addr;
+	time_t expire;
+};
+
+// Hash table of verified results by query, oldest entries first in the fifo
+static struct verified_t **g_verified = NULL;
+static struct verified_t *g_verified_oldest = NULL;
+static struct verified_t *g_verified_newest = NULL;
+static int g_verified_num = 0;
 
 
 static const char *str_state(int state)
@@ -51,39 +181,438 @@ static const char *str_state(int state)
 	}
 }
 
+static const char *str_locality(int locality)
+{
+	switch(locality) {
+	case LOCALITY_LOOPBACK: return "LOOPBACK";
+	case LOCALITY_SUBNET: return "SUBNET";
+	case LOCALITY_PRIVATE: return "PRIVATE";
+	case LOCALITY_GLOBAL: return "GLOBAL";
+	default:
+		log_error("Invalid locality: %d", locality);
+		exit(1);
+	}
+}
+
+static const char *str_reason(int reason)
+{
+	switch(reason) {
+	case NEGATIVE_NO_VALUES: return "NO_VALUES";
+	case NEGATIVE_AUTH_FAILED: return "AUTH_FAILED";
+	case NEGATIVE_UNSUPPORTED: return "UNSUPPORTED";
+	default:
+		log_error("Invalid reason: %d", reason);
+		exit(1);
+	}
+}
+
+// The id is a SHA1 hash already
+static int id_slot(const uint8_t id[])
+{
+	uint32_t hash;
+
+	memcpy(&hash, id, sizeof(hash));
+
+	return hash & (g_buckets_num - 1);
+}
+
+// FNV-1a
+static int query_slot(const char query[])
+{
+	uint32_t hash = 2166136261U;
+
+	while (*query) {
+		hash = (hash ^ (uint8_t) *query++) * 16777619U;
+	}
+
+	return hash & (g_buckets_num - 1);
+}
+
 struct search_t *searches_find_by_id(const uint8_t id[])
 {
-	struct search_t **searches;
+	struct search_t *search;
 
-	searches = &g_searches[0];
-	while (*searches) {
-		if (memcmp((*searches)->id, id, SHA1_BIN_LENGTH) == 0) {
-			return *searches;
+	if (g_buckets_num == 0) {
+		return NULL;
+	}
+
+	search = g_by_id[id_slot(id)];
+	while (search) {
+		if (memcmp(search->id, id, SHA1_BIN_LENGTH) == 0) {
+			return search;
 		}
-		searches++;
+		search = search->id_next;
 	}
 
 	return NULL;
 }
 
-
 static struct search_t *searches_find_by_query(const char query[])
 {
-	struct search_t **search;
-	struct search_t *searches;
+	struct search_t *search;
+
+	if (g_buckets_num == 0) {
+		return NULL;
+	}
+
+	search = g_by_query[query_slot(query)];
+	while (search) {
+		if (0 == strcmp(query, &search->query[0])) {
+			return search;
+		}
+		search = search->query_next;
+	}
+
+	return NULL;
+}
+
+static void searches_unlink(struct search_t *search)
+{
+	if (search->prev) {
+		search->prev->next = search->next;
+	} else {
+		g_searches = search->next;
+	}
+
+	if (search->next) {
+		search->next->prev = search->prev;
+	} else {
+		g_searches_last = search->prev;
+	}
+
+	search->prev = NULL;
+	search->next = NULL;
+}
+
+// Move search to the front of the list
+static void searches_link(struct search_t *search)
+{
+	search->prev = NULL;
+	search->next = g_searches;
+
+	if (g_searches) {
+		g_searches->prev = search;
+	} else {
+		g_searches_last = search;
+	}
+
+	g_searches = search;
+}
+
+// Get next address to authenticate, starting at result
+static struct result_t *find_next_result(struct result_t *result)
+{
+	while (result) {
+		if (result->state == AUTH_WAITING || result->state == AUTH_AGAIN) {
+			return result;
+		}
+		result = result->next;
+	}
+
+	return NULL;
+}
+
+static struct auth_queue *auth_queue_get(auth_callback *callback)
+{
+	int i;
+
+	for (i = 0; i < AUTH_QUEUES_MAX; i++) {
+		if (g_auth_queues[i].callback == callback) {
+			return &g_auth_queues[i];
+		}
+
+		if (g_auth_queues[i].callback == NULL) {
+			g_auth_queues[i].callback = callback;
+			g_auth_queues[i].race = SEARCHES_AUTH_RACE;
+			return &g_auth_queues[i];
+		}
+	}
+
+	log_error("Searches: Too many authentication methods");
+	exit(1);
+}
+
+// Append search to the queue of its authentication method
+static void auth_enqueue(struct search_t *search)
+{
+	struct auth_queue *queue;
+
+	if (search->callback == NULL || search->done || search->auth_queued) {
+		return;
+	}
+
+	queue = auth_queue_get(search->callback);
+
+	search->auth_prev = queue->last;
+	search->auth_next = NULL;
+
+	if (queue->last) {
+		queue->last->auth_next = search;
+	} else {
+		queue->first = search;
+	}
+
+	queue->last = search;
+	queue->num += 1;
+	search->auth_queued = 1;
+}
+
+static void auth_dequeue(struct search_t *search)
+{
+	struct auth_queue *queue;
+
+	if (!search->auth_queued) {
+		return;
+	}
+
+	queue = auth_queue_get(search->callback);
+
+	if (search->auth_prev) {
+		search->auth_prev->auth_next = search->auth_next;
+	} else {
+		queue->first = search->auth_next;
+	}
+
+	if (search->auth_next) {
+		search->auth_next->auth_prev = search->auth_prev;
+	} else {
+		queue->last = search->auth_prev;
+	}
+
+	search->auth_prev = NULL;
+	search->auth_next = NULL;
+	search->auth_queued = 0;
+	queue->num -= 1;
+}
+
+static void searches_insert(struct search_t *search)
+{
+	int i;
+
+	i = id_slot(search->id);
+	search->id_next = g_by_id[i];
+	g_by_id[i] = search;
+
+	i = query_slot(search->query);
+	search->query_next = g_by_query[i];
+	g_by_query[i] = search;
+
+	searches_link(search);
+	g_searches_num += 1;
+}
+
+static void searches_remove(struct search_t *search)
+{
+	struct search_t **cur;
+
+	auth_dequeue(search);
+
+	cur = &g_by_id[id_slot(search->id)];
+	while (*cur) {
+		if (*cur == search) {
+			*cur = search->id_next;
+			break;
+		}
+		cur = &(*cur)->id_next;
+	}
+
+	cur = &g_by_query[query_slot(search->query)];
+	while (*cur) {
+		if (*cur == search) {
+			*cur = search->query_next;
+			break;
+		}
+		cur = &(*cur)->query_next;
+	}
+
+	searches_unlink(search);
+	g_searches_num -= 1;
+}
+
+static struct negative_t *negative_find(const char query[])
+{
+	struct negative_t *negative;
+
+	negative = g_negatives[query_slot(query)];
+	while (negative) {
+		if (0 == strcmp(query, negative->query)) {
+			return negative;
+		}
+		negative = negative->next;
+	}
+
+	return NULL;
+}
+
+static void negative_remove_oldest(void)
+{
+	struct negative_t *negative;
+	struct negative_t **cur;
+
+	negative = g_negatives_oldest;
+
+	cur = &g_negatives[query_slot(negative->query)];
+	while (*cur) {
+		if (*cur == negative) {
+			*cur = negative->next;
+			break;
+		}
+		cur = &(*cur)->next;
+	}
+
+	g_negatives_oldest = negative->fifo_next;
+	if (g_negatives_oldest == NULL) {
+		g_negatives_newest = NULL;
+	}
+
+	g_negatives_num -= 1;
+	free(negative);
+}
+
+static void negative_add(const char query[], enum NEGATIVE_REASON reason)
+{
+	struct negative_t *negative;
+	int i;
+
+	if (gconf->search_negative_ttl == 0 || negative_find(query)) {
+		return;
+	}
+
+	if (g_negatives_num >= gconf->search_cache_size) {
+		negative_remove_oldest();
+	}
+
+	negative = (struct negative_t*) calloc(1, sizeof(struct negative_t));
+	if (negative == NULL) {
+		return;
+	}
+
+	log_debug("Searches: Query failed (%s): %s", str_reason(reason), query);
+
+	memcpy(negative->query, query, strlen(query));
+	negative->reason = reason;
+	negative->expire = time_now_sec() + gconf->search_negative_ttl;
+
+	i = query_slot(query);
+	negative->next = g_negatives[i];
+	g_negatives[i] = negative;
+
+	// All entries have the same lifetime, append to the end
+	if (g_negatives_newest) {
+		g_negatives_newest->fifo_next = negative;
+	} else {
+		g_negatives_oldest = negative;
+	}
+	g_negatives_newest = negative;
+	g_negatives_num += 1;
+}
+
+int searches_negative(const char query[])
+{
+	struct negative_t *negative;
+
+	if (g_negatives_num == 0) {
+		return -1;
+	}
+
+	negative = negative_find(query);
+	if (negative && negative->expire > time_now_sec()) {
+		return negative->reason;
+	}
+
+	return -1;
+}
+
+static struct verified_t *verified_find(const char query[], const IP *addr)
+{
+	struct verified_t *verified;
+
+	if (g_verified_num == 0) {
+		return NULL;
+	}
 
-	search = &g_searches[0];
-	while (*search) {
-		searches = *search;
-		if (0 == strcmp(query, &searches->query[0])) {
-			return searches;
+	verified = g_verified[query_slot(query)];
+	while (verified) {
+		if (verified->expire > time_now_sec()
+				&& addr_equal(&verified->addr, addr)
+				&& 0 == strcmp(query, verified->query)) {
+			return verified;
 		}
-		search++;
+		verified = verified->next;
 	}
 
 	return NULL;
 }
 
+static void verified_remove_oldest(void)
+{
+	struct verified_t *verified;
+	struct verified_t **cur;
+
+	verified = g_verified_oldest;
+
+	cur = &g_verified[query_slot(verified->query)];
+	while (*cur) {
+		if (*cur == verified) {
+			*cur = verified->next;
+			break;
+		}
+		cur = &(*cur)->next;
+	}
+
+	g_verified_oldest = verified->fifo_next;
+	if (g_verified_oldest == NULL) {
+		g_verified_newest = NULL;
+	}
+
+	g_verified_num -= 1;
+	free(verified);
+}
+
+// Remember a verified result, never extends the lifetime of an existing entry
+void searches_add_verified(const char query[], const IP *addr, time_t expire)
+{
+	struct verified_t *verified;
+	int i;
+
+	if (gconf->search_verified_ttl == 0) {
+		return;
+	}
+
+	expire = MIN(expire, time_now_sec() + gconf->search_verified_ttl);
+
+	verified = verified_find(query, addr);
+	if (verified) {
+		verified->expire = MIN(verified->expire, expire);
+		return;
+	}
+
+	if (g_verified_num >= gconf->search_cache_size) {
+		verified_remove_oldest();
+	}
+
+	verified = (struct verified_t*) calloc(1, sizeof(struct verified_t));
+	if (verified == NULL) {
+		return;
+	}
+
+	memcpy(verified->query, query, strlen(query));
+	memcpy(&verified->addr, addr, sizeof(IP));
+	verified->expire = expire;
+
+	i = query_slot(query);
+	verified->next = g_verified[i];
+	g_verified[i] = verified;
+
+	if (g_verified_newest) {
+		g_verified_newest->fifo_next = verified;
+	} else {
+		g_verified_oldest = verified;
+	}
+	g_verified_newest = verified;
+	g_verified_num += 1;
+}
+
 // Free a search_t struct
 void search_free(struct search_t *search)
 {
@@ -100,60 +629,226 @@ void search_free(struct search_t *search)
 	free(search);
 }
 
-// Get next address to authenticate
-static struct result_t *find_next_result(struct search_t *search)
+
+
+// A search is complete if a result was verified or no result is left to verify
+static int search_is_complete(const struct search_t *search)
+{
+	const struct result_t *result;
+
+	if (search->done) {
+		return 1;
+	}
+
+	if (search->results == NULL) {
+		// Still waiting for the DHT
+		return 0;
+	}
+
+	result = search->results;
+	while (result) {
+		if (result->state == AUTH_WAITING || result->state == AUTH_AGAIN || result->state == AUTH_PROGRESS) {
+			return 0;
+		}
+		result = result->next;
+	}
+
+	return 1;
+}
+
+// Check if all results failed authentication or did not reply
+static int search_is_failed(const struct search_t *search)
+{
+	const struct result_t *result;
+
+	if (search->done || search->pending || search->results == NULL) {
+		return 0;
+	}
+
+	result = search->results;
+	while (result) {
+		if (result->state != AUTH_FAILED && result->state != AUTH_ERROR) {
+			return 0;
+		}
+		result = result->next;
+	}
+
+	return 1;
+}
+
+// A result was verified, skip all other results
+static void search_verified(struct search_t *search)
 {
 	struct result_t *result;
 
+	search->done = 1;
+	auth_dequeue(search);
+
 	result = search->results;
 	while (result) {
-		if (result->state == AUTH_WAITING || result->state == AUTH_AGAIN) {
-			return result;
+		if (result->state == AUTH_WAITING) {
+			result->state = AUTH_SKIP;
 		}
 		result = result->next;
 	}
+}
 
-	return NULL;
+// Replace a failed search by a negative cache entry
+static void search_fail(struct search_t *search, enum NEGATIVE_REASON reason)
+{
+	negative_add(search->query, reason);
+	searches_remove(search);
+	search_free(search);
 }
 
-// Get next search to authenticate
-static struct search_t *find_next_search(auth_callback *callback)
+// Remove the least recently used search, prefer completed searches
+static void searches_evict(void)
 {
-	struct search_t **searches;
+	struct search_t *victim;
+	struct search_t *search;
+	int i;
+
+	victim = NULL;
+	search = g_searches_last;
+	for (i = 0; search && i < SEARCHES_EVICT_SCAN; search = search->prev) {
+		// Warm up searches are kept
+		if (search->warmup) {
+			continue;
+		}
+
+		if (victim == NULL) {
+			victim = search;
+		}
 
-	searches = &g_searches[0];
-	while (*searches) {
-		if (!(*searches)->done && (*searches)->callback == callback) {
-			return *searches;
+		if (search_is_complete(search)) {
+			victim = search;
+			break;
 		}
-		searches++;
+
+		i += 1;
 	}
-	return NULL;
+
+	if (victim == NULL) {
+		// Only warm up searches
+		victim = g_searches_last;
+	}
+
+	log_debug("Searches: Remove search for query: %s", victim->query);
+
+	searches_remove(victim);
+	search_free(victim);
+}
+
+/*
+* Get next result of a search to authenticate. Alternate between
+* IPv6 and IPv4 addresses and count results that are in progress.
+*/
+static struct result_t *find_auth_result(struct search_t *search, int *pending, int *progress)
+{
+	struct result_t *result;
+	struct result_t *first;
+	struct result_t *other;
+
+	*pending = 0;
+	*progress = 0;
+	first = NULL;
+	other = NULL;
+
+	result = search->results;
+	while (result) {
+		if (result->state == AUTH_WAITING || result->state == AUTH_AGAIN) {
+			if (first == NULL) {
+				first = result;
+			}
+			if (other == NULL && result->addr.ss_family != search->auth_family) {
+				other = result;
+			}
+			*pending += 1;
+		} else if (result->state == AUTH_PROGRESS) {
+			*progress += 1;
+		}
+		result = result->next;
+	}
+
+	return other ? other : first;
 }
 
 // Find query/IP-address to authenticate; callback is used as a marker.
 struct result_t *searches_get_auth_target(char query[], IP *addr, auth_callback *callback)
 {
+	struct auth_queue *queue;
 	struct search_t *search;
 	struct result_t *result;
+	uint64_t now;
+	int progress;
+	int pending;
+	int turns;
+
+	queue = auth_queue_get(callback);
+	now = time_now_ms();
+
+	// Give every queued search one turn
+	for (turns = queue->num; turns > 0 && (search = queue->first) != NULL; turns--) {
+		auth_dequeue(search);
+
+		// Get next result to authenticate
+		result = find_auth_result(search, &pending, &progress);
+		if (result == NULL) {
+			continue;
+		}
 
-	// Get next search to authenticate
-	search = find_next_search(callback);
-	if (search == NULL) {
-		return NULL;
+		// Race results of a search, but start them staggered
+		if (queue->race > 0 && (progress >= queue->race
+				|| (progress > 0 && now < (search->auth_time + SEARCHES_AUTH_STAGGER_MS)))) {
+			if (progress < queue->race) {
+				// Wake up the idle handlers of the authentication methods
+				net_wakeup(search->auth_time + SEARCHES_AUTH_STAGGER_MS);
+			}
+			auth_enqueue(search);
+			continue;
+		}
+
+		// Other results of this search wait for the next round
+		if (pending > 1) {
+			auth_enqueue(search);
+		}
+
+		search->auth_time = now;
+		search->auth_family = result->addr.ss_family;
+
+		// Set query and address to authenticate
+		memcpy(query, &search->query, sizeof(search->query));
+		memcpy(addr, &result->addr, sizeof(IP));
+
+		return result;
 	}
 
-	// Get next result to authenticate
-	result = find_next_result(search);
-	if (result == NULL) {
-		return NULL;
+	return NULL;
+}
+
+void searches_set_rtt(const char query[], const IP *addr, uint32_t rtt)
+{
+	struct search_t *search;
+	struct result_t *result;
+
+	search = searches_find_by_query(query);
+	if (search == NULL) {
+		return;
 	}
 
-	// Set query and address to authenticate
-	memcpy(query, &search->query, sizeof(search->query));
-	memcpy(addr, &result->addr, sizeof(IP));
+	result = search->results;
+	while (result) {
+		if (addr_equal(&result->addr, addr)) {
+			result->rtt = MAX(rtt, 1);
+			break;
+		}
+		result = result->next;
+	}
+}
 
-	return result;
+void searches_set_auth_race(auth_callback *callback, int race)
+{
+	auth_queue_get(callback)->race = race;
 }
 
 // Set the authentication state of a result
@@ -179,50 +874,99 @@ void searches_set_auth_state(const char query[], const IP *addr, const int state
 
 		// Skip all other results if we found one that is ok
 		if (state == AUTH_OK) {
-			search->done = 1;
-			result = search->results;
-			while (result) {
-				if (result->state == AUTH_WAITING) {
-					result->state = AUTH_SKIP;
-				}
-				result = result->next;
+			searches_add_verified(query, addr, LONG_MAX);
+			search_verified(search);
+		} else if (search_is_failed(search)) {
+			// Callers might still hold the search, remove it later
+			if (!search->failed) {
+				search->failed = 1;
+				g_failed_num += 1;
+				net_wakeup(time_now_ms());
 			}
+		} else if (state == AUTH_WAITING || state == AUTH_AGAIN) {
+			auth_enqueue(search);
 		}
 	}
 }
 
+void searches_done(struct search_t *search)
+{
+	if (search->pending) {
+		return;
+	}
+
+	if (search->results == NULL) {
+		search_fail(search, NEGATIVE_NO_VALUES);
+	} else if (search_is_failed(search)) {
+		search_fail(search, NEGATIVE_AUTH_FAILED);
+	}
+}
+
 void searches_debug(FILE *fp)
 {
-	struct search_t **searches;
+	struct verified_t *verified;
+	struct negative_t *negative;
 	struct search_t *search;
 	struct result_t *result;
 	int result_counter;
 	int search_counter;
+	time_t now;
 
+	now = time_now_sec();
 	search_counter = 0;
-	searches = &g_searches[0];
+	search = g_searches;
 
 	fprintf(fp, "Result buckets:\n");
-	while (*searches) {
-		search = *searches;
+	while (search) {
 		fprintf(fp, " query: '%s'\n", &search->query[0]);
 		fprintf(fp, "  id: %s\n", str_id(search->id));
 		fprintf(fp, "  done: %s\n", search->done ? "true" : "false");
 		fprintf(fp, "  callback: %s\n", search->callback ? "yes" : "no");
+		fprintf(fp, "  hits: %u\n", search->hits);
+		fprintf(fp, "  warmup: %s\n", search->warmup ? "yes" : "no");
 		result_counter = 0;
 		result = search->results;
 		while (result) {
 			fprintf(fp, "   addr: %s\n", str_addr(&result->addr));
 			fprintf(fp, "   state: %s\n", str_state(result->state));
+			fprintf(fp, "   expires in: %ld min\n", (result->expire - now) / 60);
+			fprintf(fp, "   locality: %s\n", str_locality(result->locality));
+			if (result->rtt) {
+				fprintf(fp, "   rtt: %u ms\n", result->rtt);
+			}
 			result_counter += 1;
 			result = result->next;
 		}
 		fprintf(fp, "  Found %d results.\n", result_counter);
-		result_counter += 1;
 		search_counter += 1;
-		searches++;
+		search = search->next;
+	}
+	fprintf(fp, " Found %d searches (cache size %d).\n", search_counter, gconf->search_cache_size);
+	fprintf(fp, " Refreshed %u searches in background.\n", g_prefetch_count);
+
+	fprintf(fp, "Failed queries:\n");
+	negative = g_negatives_oldest;
+	while (negative) {
+		if (negative->expire > now) {
+			fprintf(fp, " query: '%s'\n", negative->query);
+			fprintf(fp, "  reason: %s\n", str_reason(negative->reason));
+			fprintf(fp, "  expires in: %ld sec\n", negative->expire - now);
+		}
+		negative = negative->fifo_next;
 	}
-	fprintf(fp, " Found %d searches.\n", search_counter);
+	fprintf(fp, " Found %d failed queries (time to live %d sec).\n", g_negatives_num, gconf->search_negative_ttl);
+
+	fprintf(fp, "Verified results:\n");
+	verified = g_verified_oldest;
+	while (verified) {
+		if (verified->expire > now) {
+			fprintf(fp, " query: '%s'\n", verified->query);
+			fprintf(fp, "  addr: %s\n", str_addr(&verified->addr));
+			fprintf(fp, "  expires in: %ld sec\n", verified->expire - now);
+		}
+		verified = verified->fifo_next;
+	}
+	fprintf(fp, " Found %d verified results (time to live %d sec).\n", g_verified_num, gconf->search_verified_ttl);
 }
 
 static void search_restart(struct search_t *search)
@@ -230,12 +974,15 @@ static void search_restart(struct search_t *search)
 	struct result_t *result;
 	struct result_t *prev;
 	struct result_t *next;
+	int verified;
 	int remove;
 
 	log_debug("Searches: Restart search for query: %s", search->query);
 
 	search->start_time = time_now_sec();
+	search->hits = 0;
 	search->done = 0;
+	verified = 0;
 
 	remove = 0;
 	next = NULL;
@@ -252,8 +999,12 @@ static void search_restart(struct search_t *search)
 			// Remove result
 			break;
 		case AUTH_OK:
-			// Check again on another search
-			result->state = AUTH_AGAIN;
+			// Check again on another search, unless verified recently
+			if (search->callback && verified_find(search->query, &result->addr)) {
+				verified = 1;
+			} else {
+				result->state = AUTH_AGAIN;
+			}
 			break;
 		case AUTH_SKIP:
 			// Continue check
@@ -282,6 +1033,12 @@ static void search_restart(struct search_t *search)
 			result = result->next;
 		}
 	}
+
+	if (verified) {
+		search_verified(search);
+	} else if (find_next_result(search->results)) {
+		auth_enqueue(search);
+	}
 }
 
 // Start a new search for a sanitized query
@@ -294,6 +1051,11 @@ struct search_t* searches_start(const char query[])
 
 	// Find existing search
 	if ((search = searches_find_by_query(query)) != NULL) {
+		// Mark as most recently used
+		searches_unlink(search);
+		searches_link(search);
+		search->hits += 1;
+
 		// Restart search after half of search lifetime
 		if ((time_now_sec() - search->start_time) > (MAX_SEARCH_LIFETIME / 2)) {
 			search_restart(search);
@@ -323,29 +1085,129 @@ struct search_t* searches_start(const char query[])
 	} else {
 		// No idea what to do
 		log_debug("Searches: No idea how what method to use for %s", query);
+		negative_add(query, NEGATIVE_UNSUPPORTED);
 		return NULL;
 	}
 
 	new = calloc(1, sizeof(struct search_t));
+	if (new == NULL) {
+		return NULL;
+	}
+
 	memcpy(new->id, id, sizeof(id));
 	new->callback = callback;
 	memcpy(&new->query, query, sizeof(new->query));
 	new->start_time = time_now_sec();
+	// Try IPv6 first
+	new->auth_family = AF_INET;
 
 	log_debug("Searches: Create new search for query: %s", query);
 
-	// Free slot if taken
-	if (g_searches[g_searches_idx] != NULL) {
-		// Remove and abort entire search
-		search_free(g_searches[g_searches_idx]);
+	// Make room for the new search
+	if (g_searches_num >= gconf->search_cache_size) {
+		searches_evict();
 	}
 
-	g_searches[g_searches_idx] = new;
-	g_searches_idx = (g_searches_idx + 1) % MAX_SEARCHES;
+	searches_insert(new);
 
 	return new;
 }
 
+static const uint8_t *addr_bytes(const struct sockaddr *addr)
+{
+	if (addr->sa_family == AF_INET6) {
+		return (const uint8_t *) &((const IP6 *) addr)->sin6_addr;
+	} else {
+		return (const uint8_t *) &((const IP4 *) addr)->sin_addr;
+	}
+}
+
+// Check if the address is in the subnet of a local interface
+static int addr_is_subnet(const IP *addr)
+{
+	const struct ifaddrs *ifa;
+	const uint8_t *mask;
+	const uint8_t *a;
+	const uint8_t *b;
+	int len;
+	int i;
+
+	len = (addr->ss_family == AF_INET6) ? 16 : 4;
+
+	for (ifa = g_ifaddrs; ifa; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_netmask == NULL
+				|| ifa->ifa_addr->sa_family != addr->ss_family) {
+			continue;
+		}
+
+		a = addr_bytes((const struct sockaddr *) addr);
+		b = addr_bytes(ifa->ifa_addr);
+		mask = addr_bytes(ifa->ifa_netmask);
+		for (i = 0; i < len; i++) {
+			if ((a[i] & mask[i]) != (b[i] & mask[i])) {
+				break;
+			}
+		}
+
+		if (i == len) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Private and link-local addresses (RFC 1918, RFC 3927, RFC 4193, RFC 4291)
+static int addr_is_private(const IP *addr)
+{
+	const uint8_t *a = addr_bytes((const struct sockaddr *) addr);
+
+	if (addr->ss_family == AF_INET6) {
+		return (a[0] & 0xfe) == 0xfc || (a[0] == 0xfe && (a[1] & 0xc0) == 0x80);
+	} else {
+		return a[0] == 10 || (a[0] == 172 && (a[1] & 0xf0) == 16)
+			|| (a[0] == 192 && a[1] == 168) || (a[0] == 169 && a[1] == 254);
+	}
+}
+
+static enum RESULT_LOCALITY result_locality(const IP *addr)
+{
+	if (addr_is_localhost(addr)) {
+		return LOCALITY_LOOPBACK;
+	} else if (addr_is_subnet(addr)) {
+		return LOCALITY_SUBNET;
+	} else if (addr_is_private(addr)) {
+		return LOCALITY_PRIVATE;
+	} else {
+		return LOCALITY_GLOBAL;
+	}
+}
+
+// Compare results, negative if result1 is better
+static int result_cmp(const struct result_t *result1, const struct result_t *result2)
+{
+	if (result1->locality != result2->locality) {
+		return result1->locality - result2->locality;
+	}
+
+	// Measured results first, fastest first
+	if (result1->rtt != result2->rtt) {
+		if (result1->rtt == 0) {
+			return 1;
+		} else if (result2->rtt == 0) {
+			return -1;
+		} else {
+			return (result1->rtt < result2->rtt) ? -1 : 1;
+		}
+	}
+
+	if (result1->addr.ss_family != result2->addr.ss_family) {
+		return (result1->addr.ss_family == AF_INET6) ? -1 : 1;
+	}
+
+	return 0;
+}
+
 // Add an address to an array if it is not already contained in there
 void searches_add_addr(struct search_t *search, const IP *addr)
 {
@@ -368,11 +1230,12 @@ void searches_add_addr(struct search_t *search, const IP *addr)
 		last = cur;
 
 		if (addr_equal(&cur->addr, addr)) {
-			// Address already listed
-			return;
-		}
-
-		if (count > MAX_RESULTS_PER_SEARCH) {
+			// Address already listed, extend lifetime
+			cur->expire = time_now_sec() + MAX_SEARCH_LIFETIME;
+			// Seen again is all we can check without authentication
+			if (search->callback == NULL && cur->state == AUTH_AGAIN) {
+				cur->state = AUTH_OK;
+			}
 			return;
 		}
 
@@ -380,9 +1243,19 @@ void searches_add_addr(struct search_t *search, const IP *addr)
 		cur = cur->next;
 	}
 
+	if (count >= gconf->search_max_results) {
+		return;
+	}
+
 	new = calloc(1, sizeof(struct result_t));
+	if (new == NULL) {
+		return;
+	}
+
 	memcpy(&new->addr, addr, sizeof(IP));
 	new->state = search->callback ? AUTH_WAITING : AUTH_OK;
+	new->expire = time_now_sec() + MAX_SEARCH_LIFETIME;
+	new->locality = result_locality(addr);
 
 	// Append new entry to list
 	if (last) {
@@ -391,47 +1264,326 @@ void searches_add_addr(struct search_t *search, const IP *addr)
 		search->results = new;
 	}
 
+	// Verified before, no need to authenticate again
+	if (search->callback && verified_find(search->query, addr)) {
+		log_debug("Searches: Result was verified before %s: %s", str_addr(addr), search->query);
+		new->state = AUTH_OK;
+		search_verified(search);
+		return;
+	}
+
 	if (search->callback) {
+		auth_enqueue(search);
 		search->callback();
 	}
 }
 
 int searches_collect_addrs(const struct search_t *search, IP addr_array[], size_t addr_num)
 {
+	const struct result_t *sorted[SEARCHES_MAX_RESULTS_LIMIT];
 	const struct result_t *cur;
+	time_t now;
+	size_t num;
 	size_t i;
 
 	if (search == NULL) {
 		return 0;
 	}
 
-	i = 0;
+	// Insertion sort, keeps arrival order of equal results
+	now = time_now_sec();
+	num = 0;
 	cur = search->results;
-	while (cur && i < addr_num) {
-		if (cur->state == AUTH_OK || cur->state == AUTH_AGAIN) {
-			memcpy(&addr_array[i], &cur->addr, sizeof(IP));
-			i += 1;
+	while (cur && num < ARRAY_SIZE(sorted)) {
+		if ((cur->state == AUTH_OK || cur->state == AUTH_AGAIN) && cur->expire > now) {
+			i = num;
+			while (i > 0 && result_cmp(cur, sorted[i - 1]) < 0) {
+				sorted[i] = sorted[i - 1];
+				i -= 1;
+			}
+			sorted[i] = cur;
+			num += 1;
 		}
 		cur = cur->next;
 	}
 
-	return i;
+	num = MIN(num, addr_num);
+	for (i = 0; i < num; i++) {
+		memcpy(&addr_array[i], &sorted[i]->addr, sizeof(IP));
+	}
+
+	return num;
+}
+
+
+// Remove results that were not seen again for some time
+static void search_expire_results(struct search_t *search, time_t now)
+{
+	struct result_t **cur;
+	struct result_t *result;
+
+	cur = &search->results;
+	while (*cur) {
+		result = *cur;
+		// Keep results that are being authenticated
+		if (result->expire <= now && result->state != AUTH_PROGRESS) {
+			log_debug("Searches: Result expired for %s: %s", search->query, str_addr(&result->addr));
+			*cur = result->next;
+			free(result);
+		} else {
+			cur = &result->next;
+		}
+	}
+}
+
+static void searches_update_ifaddrs(void)
+{
+	if (g_ifaddrs) {
+		freeifaddrs(g_ifaddrs);
+		g_ifaddrs = NULL;
+	}
+
+	if (getifaddrs(&g_ifaddrs) < 0) {
+		log_debug("Searches: getifaddrs() failed: %s", strerror(errno));
+		g_ifaddrs = NULL;
+	}
+}
+
+// Restart searches of frequently used names before their results get old
+static void searches_prefetch(time_t now)
+{
+	uint8_t ids[SEARCHES_PREFETCH_MAX][SHA1_BIN_LENGTH];
+	struct search_t *search;
+	int count;
+	int i;
+
+	// Collect first, restarting a search might free other searches
+	count = 0;
+	search = g_searches;
+	while (search && count < SEARCHES_PREFETCH_MAX) {
+		if ((search->hits >= SEARCHES_PREFETCH_HITS || search->warmup) && search->pending == 0
+				&& (now - search->start_time) >= (MAX_SEARCH_LIFETIME / 2 - SEARCHES_PREFETCH_MARGIN)) {
+			memcpy(ids[count], search->id, SHA1_BIN_LENGTH);
+			count += 1;
+		}
+		search = search->next;
+	}
+
+	for (i = 0; i < count; i++) {
+		search = searches_find_by_id(ids[i]);
+		if (search == NULL) {
+			continue;
+		}
+
+		log_debug("Searches: Refresh search in background: %s", search->query);
+
+		search_restart(search);
+		kad_start_search(search);
+		g_prefetch_count += 1;
+
+		// Verify results again that were already found
+		if (search->callback) {
+			search->callback();
+		}
+	}
+}
+
+int searches_add_warmup(const char name[])
+{
+	struct warmup *new;
+
+	new = (struct warmup *) malloc(sizeof(struct warmup));
+	if (new == NULL) {
+		return -1;
+	}
+
+	new->name = strdup(name);
+	if (new->name == NULL) {
+		free(new);
+		return -1;
+	}
+
+	new->next = g_warmups;
+	g_warmups = new;
+
+	return 0;
+}
+
+// Start searches for all warm up names that have no search
+static void searches_warmup(time_t now)
+{
+	char query[QUERY_MAX_SIZE];
+	struct search_t *search;
+	struct warmup *warmup;
+	int count;
+
+	count = 0;
+	warmup = g_warmups;
+	while (warmup) {
+		if (EXIT_FAILURE == query_sanitize(query, sizeof(query), warmup->name)) {
+			log_warning("Searches: Invalid warm up name: %s", warmup->name);
+		} else if ((search = searches_start(query)) == NULL) {
+			log_warning("Searches: Cannot warm up name: %s", warmup->name);
+		} else {
+			search->warmup = 1;
+			if (search->start_time == now) {
+				kad_start_search(search);
+				count += 1;
+			}
+		}
+		warmup = warmup->next;
+	}
+
+	if (count) {
+		log_info("Searches: Started %d warm up searches", count);
+	}
 }
 
+// Remove searches whose results failed authentication
+static void searches_remove_failed(void)
+{
+	struct search_t *search;
+	struct search_t *next;
 
-void searches_setup(void)
+	search = g_searches;
+	while (search) {
+		next = search->next;
+		if (search->failed) {
+			search->failed = 0;
+
+			// New results might have arrived meanwhile
+			if (search_is_failed(search)) {
+				search_fail(search, NEGATIVE_AUTH_FAILED);
+			}
+		}
+		search = next;
+	}
+
+	g_failed_num = 0;
+}
+
+static void searches_handle(int _rc, int _sock)
 {
-	// Nothing to do
+	struct search_t *search;
+	time_t now;
+	int nodes;
+
+	now = time_now_sec();
+
+	if (g_failed_num) {
+		searches_remove_failed();
+	}
+
+	// Oldest entries expire first
+	while (g_negatives_oldest && g_negatives_oldest->expire <= now) {
+		negative_remove_oldest();
+	}
+
+	// Entries may expire earlier, those are skipped on lookup
+	while (g_verified_oldest && g_verified_oldest->expire <= now) {
+		verified_remove_oldest();
+	}
+
+	if (g_warmups && g_warmup_time <= now) {
+		nodes = kad_count_nodes(1);
+		if (nodes >= SEARCHES_WARMUP_NODES || (nodes > 0 && (now - gconf->startup_time) >= SEARCHES_WARMUP_TIMEOUT)) {
+			searches_warmup(now);
+			g_warmup_time = now + SEARCHES_WARMUP_INTERVAL;
+		}
+	}
+
+	if (g_prefetch_time <= now) {
+		searches_prefetch(now);
+		g_prefetch_time = now + SEARCHES_PREFETCH_INTERVAL;
+	}
+
+	if (g_expire_time > now) {
+		return;
+	}
+
+	search = g_searches;
+	while (search) {
+		search_expire_results(search, now);
+		search = search->next;
+	}
+
+	// Interface addresses might have changed
+	searches_update_ifaddrs();
+
+	g_expire_time = now + SEARCHES_EXPIRE_INTERVAL;
+}
+
+int searches_setup(void)
+{
+	g_buckets_num = 1;
+	while (g_buckets_num < gconf->search_cache_size) {
+		g_buckets_num *= 2;
+	}
+
+	g_by_id = (struct search_t**) calloc(g_buckets_num, sizeof(struct search_t*));
+	g_by_query = (struct search_t**) calloc(g_buckets_num, sizeof(struct search_t*));
+	g_negatives = (struct negative_t**) calloc(g_buckets_num, sizeof(struct negative_t*));
+	g_verified = (struct verified_t**) calloc(g_buckets_num, sizeof(struct verified_t*));
+
+	if (g_by_id == NULL || g_by_query == NULL || g_negatives == NULL || g_verified == NULL) {
+		log_error("Failed to allocate search cache of size %d", gconf->search_cache_size);
+		return EXIT_FAILURE;
+	}
+
+	searches_update_ifaddrs();
+
+	// Cause the callback to be called in intervals
+	net_add_handler(-1, &searches_handle);
+
+	return EXIT_SUCCESS;
 }
 
 void searches_free(void)
 {
-	struct search_t **search;
+	struct warmup *warmup;
+	struct search_t *search;
+	struct search_t *next;
+
+	while (g_warmups) {
+		warmup = g_warmups;
+		g_warmups = warmup->next;
+		free(warmup->name);
+		free(warmup);
+	}
 
-	search = &g_searches[0];
-	while (*search) {
-		search_free(*search);
-		*search = NULL;
-		search++;
+	search = g_searches;
+	while (search) {
+		next = search->next;
+		search_free(search);
+		search = next;
 	}
+
+	while (g_negatives_oldest) {
+		negative_remove_oldest();
+	}
+
+	while (g_verified_oldest) {
+		verified_remove_oldest();
+	}
+
+	if (g_ifaddrs) {
+		freeifaddrs(g_ifaddrs);
+		g_ifaddrs = NULL;
+	}
+
+	free(g_by_id);
+	free(g_by_query);
+	free(g_negatives);
+	free(g_verified);
+
+	g_by_id = NULL;
+	g_by_query = NULL;
+	g_negatives = NULL;
+	g_verified = NULL;
+	g_buckets_num = 0;
+	g_searches = NULL;
+	g_searches_last = NULL;
+	g_searches_num = 0;
+
+	memset(g_auth_queues, 0, sizeof(g_auth_queues));
 }
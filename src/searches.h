@@ -4,6 +4,19 @@
 
 #include <stdio.h>
 
+// Default number of searches that are cached
+#define SEARCHES_CACHE_SIZE_DEFAULT 1024
+
+// Default and maximum number of results per search
+#define SEARCHES_MAX_RESULTS_DEFAULT 16
+#define SEARCHES_MAX_RESULTS_LIMIT 64
+
+// Default time in seconds to remember failed queries
+#define SEARCHES_NEGATIVE_TTL_DEFAULT 120
+
+// Default time in seconds to trust a verified result without authentication
+#define SEARCHES_VERIFIED_TTL_DEFAULT 600
+
 // Authentication states
 enum AUTH_STATE {
 	AUTH_OK, // Authentication successful or not needed
@@ -15,6 +28,21 @@ enum AUTH_STATE {
 	AUTH_WAITING // Not yet started
 };
 
+// Reasons for a failed query
+enum NEGATIVE_REASON {
+	NEGATIVE_NO_VALUES, // DHT search found no announcements
+	NEGATIVE_AUTH_FAILED, // No result passed authentication
+	NEGATIVE_UNSUPPORTED // Query cannot be mapped to an id
+};
+
+// Network proximity of a result, closest first
+enum RESULT_LOCALITY {
+	LOCALITY_LOOPBACK,
+	LOCALITY_SUBNET, // Same subnet as a local interface
+	LOCALITY_PRIVATE, // Private or link-local address
+	LOCALITY_GLOBAL
+};
+
 typedef void auth_callback(void);
 
 // An address that was received as a result of an id search
@@ -22,13 +50,33 @@ struct result_t {
 	struct result_t *next;
 	IP addr;
 	enum AUTH_STATE state;
+	time_t expire;
+	uint32_t rtt; // Round-trip time measured during authentication (ms), 0 if unknown
+	enum RESULT_LOCALITY locality;
 };
 
+// DHT searches that have not finished yet
+#define SEARCH_PENDING_IPV4 1
+#define SEARCH_PENDING_IPV6 2
+#define SEARCH_PENDING_START 4
+
 // A bucket of results received when in search of an id
 struct search_t {
 	struct search_t *next;
+	struct search_t *prev;
+	struct search_t *id_next;
+	struct search_t *query_next;
 	uint8_t id[SHA1_BIN_LENGTH];
 	uint16_t done;
+	uint16_t pending; // DHT searches in progress (SEARCH_PENDING_*)
+	unsigned int hits; // Lookups since the search was (re-)started
+	uint16_t warmup; // Name given by --warmup
+	uint16_t auth_queued; // Waiting for authentication
+	uint16_t failed; // All results failed, removed on the next tick
+	int auth_family; // Address family of the last result authenticated
+	uint64_t auth_time; // Time the last authentication started (ms)
+	struct search_t *auth_prev;
+	struct search_t *auth_next;
 	char query[QUERY_MAX_SIZE];
 	time_t start_time;
 	struct result_t *results;
@@ -38,7 +86,16 @@ struct search_t {
 void searches_set_auth_state(const char query[], const IP *addr, const int state);
 struct result_t *searches_get_auth_target(char query[], IP *addr, auth_callback *callback);
 
-void searches_setup(void);
+// Round-trip time to a result, used to rank results
+void searches_set_rtt(const char query[], const IP *addr, uint32_t rtt);
+
+// Results of a search to authenticate at once, 0 for all without delay
+void searches_set_auth_race(auth_callback *callback, int race);
+
+// Remember a verified result until expire, but not longer than --search-verified-ttl
+void searches_add_verified(const char query[], const IP *addr, time_t expire);
+
+int searches_setup(void);
 void searches_free(void);
 
 // Start a search
@@ -47,10 +104,19 @@ struct search_t *searches_start(const char query[]);
 // Find a search by infohash, so we can add results
 struct search_t *searches_find_by_id(const uint8_t id[]);
 
+// Add a name to look up as soon as the DHT is ready
+int searches_add_warmup(const char name[]);
+
+// Called when all DHT searches finished
+void searches_done(struct search_t *search);
+
+// Get the reason why a query failed recently or -1
+int searches_negative(const char query[]);
+
 // Add an address to a result bucket
 void searches_add_addr(struct search_t *search, const IP *addr);
 
-// Collect addresses
+// Collect addresses, best first
 int searches_collect_addrs(const struct search_t *search, IP addr_array[], size_t addr_num);
 
 void searches_debug(FILE *fp);
@@ -9,6 +9,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "main.h"
 #include "log.h"
@@ -629,3 +630,12 @@ time_t time_add_hours(uint32_t hours)
 {
 	return gconf->time_now + (60 * 60 * hours);
 }
+
+uint64_t time_now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t) now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
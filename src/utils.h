@@ -60,4 +60,7 @@ time_t time_add_secs(uint32_t seconds);
 time_t time_add_mins(uint32_t minutes);
 time_t time_add_hours(uint32_t hours);
 
+// Monotonic time in milliseconds, for measurements
+uint64_t time_now_ms(void);
+
 #endif // _UTILS_H_
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "net.h"
+#include "workers.h"
+
+
+struct job {
+	struct job *next;
+	worker_work *work;
+	worker_done *done;
+	void *data;
+};
+
+// Job list with first and last element
+struct job_list {
+	struct job *first;
+	struct job *last;
+};
+
+static pthread_t *g_threads = NULL;
+static int g_threads_num = 0;
+static int g_running = 0;
+
+// Both lists are protected by the mutex
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static struct job_list g_pending;
+static struct job_list g_done;
+
+// Wakes up the event loop when jobs are done
+static int g_pipe[2] = { -1, -1 };
+
+
+static void job_append(struct job_list *list, struct job *job)
+{
+	job->next = NULL;
+
+	if (list->last) {
+		list->last->next = job;
+	} else {
+		list->first = job;
+	}
+
+	list->last = job;
+}
+
+static struct job *job_take(struct job_list *list)
+{
+	struct job *job;
+
+	job = list->first;
+	if (job) {
+		list->first = job->next;
+		if (list->first == NULL) {
+			list->last = NULL;
+		}
+	}
+
+	return job;
+}
+
+static void *workers_thread(void *arg)
+{
+	int id = (int) (intptr_t) arg;
+	struct job *job;
+	int rc;
+
+	pthread_mutex_lock(&g_mutex);
+	while (g_running) {
+		job = job_take(&g_pending);
+		if (job == NULL) {
+			pthread_cond_wait(&g_cond, &g_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&g_mutex);
+
+		job->work(job->data, id);
+
+		pthread_mutex_lock(&g_mutex);
+		job_append(&g_done, job);
+
+		// A full pipe is fine, the event loop collects all done jobs at once
+		rc = write(g_pipe[1], "", 1);
+		(void) rc;
+	}
+	pthread_mutex_unlock(&g_mutex);
+
+	return NULL;
+}
+
+// Call the done functions of finished jobs
+static void workers_handle(int rc, int fd)
+{
+	struct job_list done;
+	struct job *job;
+	char buf[64];
+
+	if (rc <= 0) {
+		return;
+	}
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	pthread_mutex_lock(&g_mutex);
+	done = g_done;
+	memset(&g_done, 0, sizeof(g_done));
+	pthread_mutex_unlock(&g_mutex);
+
+	while ((job = job_take(&done)) != NULL) {
+		job->done(job->data);
+		free(job);
+	}
+}
+
+int workers_submit(worker_work *work, worker_done *done, void *data)
+{
+	struct job *job;
+
+	// Run inline without threads
+	if (g_threads_num == 0) {
+		work(data, 0);
+		done(data);
+		return EXIT_SUCCESS;
+	}
+
+	job = (struct job*) calloc(1, sizeof(struct job));
+	if (job == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	job->work = work;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&g_mutex);
+	job_append(&g_pending, job);
+	pthread_cond_signal(&g_cond);
+	pthread_mutex_unlock(&g_mutex);
+
+	return EXIT_SUCCESS;
+}
+
+int workers_count(void)
+{
+	return MAX(g_threads_num, 1);
+}
+
+int workers_setup(void)
+{
+	int i;
+
+	if (gconf->crypto_workers == 0) {
+		return EXIT_SUCCESS;
+	}
+
+	if (pipe(g_pipe) != 0) {
+		log_error("Workers: Failed to create pipe: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	net_set_nonblocking(g_pipe[0]);
+	net_set_nonblocking(g_pipe[1]);
+
+	g_threads = (pthread_t*) calloc(gconf->crypto_workers, sizeof(pthread_t));
+	if (g_threads == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	g_running = 1;
+
+	for (i = 0; i < gconf->crypto_workers; i++) {
+		if (pthread_create(&g_threads[i], NULL, &workers_thread, (void*) (intptr_t) i) != 0) {
+			log_error("Workers: Failed to create thread: %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		g_threads_num += 1;
+	}
+
+	net_add_handler(g_pipe[0], &workers_handle);
+
+	log_info("Workers: Started %d threads", g_threads_num);
+
+	return EXIT_SUCCESS;
+}
+
+void workers_free(void)
+{
+	struct job *job;
+	int i;
+
+	pthread_mutex_lock(&g_mutex);
+	g_running = 0;
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_mutex);
+
+	for (i = 0; i < g_threads_num; i++) {
+		pthread_join(g_threads[i], NULL);
+	}
+
+	free(g_threads);
+	g_threads = NULL;
+	g_threads_num = 0;
+
+	// Drop unfinished jobs
+	while ((job = job_take(&g_pending)) != NULL || (job = job_take(&g_done)) != NULL) {
+		free(job->data);
+		free(job);
+	}
+
+	// The read end is closed by net_free()
+	if (g_pipe[1] >= 0) {
+		close(g_pipe[1]);
+		g_pipe[1] = -1;
+	}
+	g_pipe[0] = -1;
+}
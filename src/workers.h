@@ -0,0 +1,33 @@
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+// Default number of threads for CPU heavy work
+#define WORKERS_DEFAULT 2
+
+/*
+* Run CPU heavy work on a pool of threads to keep the event loop
+* responsive. The work function runs on a worker thread and must not
+* touch global state. The done function is called from the event loop
+* afterwards. Without threads (--crypto-workers 0), both are called
+* right away.
+*
+* The data is allocated by the caller and released by the done function.
+* Data of unfinished jobs is released with free() on shutdown.
+*/
+
+// Called on a worker thread, id is the index of the worker
+typedef void worker_work(void *data, int id);
+
+// Called on the main thread
+typedef void worker_done(void *data);
+
+int workers_submit(worker_work *work, worker_done *done, void *data);
+
+// Number of worker ids, for per-worker state
+int workers_count(void);
+
+int workers_setup(void);
+void workers_free(void);
+
+#endif // _WORKERS_H_